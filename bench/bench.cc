@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// one timed run of a benchmark. `rss` is in kilobytes.
+struct sample {
+	double ms;
+	long rss;
+};
+
+static bool run(char const *ematrm, std::string const &path, bool profile, sample &sample, std::string &err_out);
+static long count_ops(std::string const &report);
+static std::string input_path(std::string const &path);
+
+int
+main(int argc, char const *argv[])
+{
+	char const *ematrm = nullptr;
+	std::vector<std::string> paths;
+	int runs = 5;
+	
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-n") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			runs = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && !ematrm)
+			ematrm = argv[i];
+		else if (argv[i][0] != '-')
+			paths.push_back(argv[i]);
+		else {
+			ematrm = nullptr;
+			break;
+		}
+	}
+	
+	if (!ematrm || paths.empty()) {
+		std::cerr << "usage: " << argv[0] << " [-n <runs>] <ematrm> <file>...\n";
+		return 1;
+	}
+	
+	std::cout << "{\n\t\"runs\": " << runs << ",\n\t\"benchmarks\": [";
+	for (size_t i = 0; i < paths.size(); ++i) {
+		std::string const &path = paths[i];
+		
+		// source operations are counted once, by a profiled run which is
+		// not itself timed. unlike compiled instructions, their number does
+		// not change with what the optimizer fuses or how loops are resolved,
+		// so that builds compare.
+		sample sample;
+		std::string report;
+		if (!run(ematrm, path, true, sample, report)) {
+			std::cerr << "err: failed to run " << path << "!\n";
+			return 1;
+		}
+		long ops = count_ops(report);
+		
+		std::vector<double> times;
+		long rss = 0;
+		for (int j = 0; j < runs; ++j) {
+			if (!run(ematrm, path, false, sample, report)) {
+				std::cerr << "err: failed to run " << path << "!\n";
+				return 1;
+			}
+			times.push_back(sample.ms);
+			rss = std::max(rss, sample.rss);
+		}
+		std::sort(times.begin(), times.end());
+		double median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+		
+		std::string name = path.substr(path.rfind('/') + 1);
+		name = name.substr(0, name.rfind('.'));
+		
+		char buf[512];
+		snprintf(buf, sizeof(buf),
+		         "%s\n\t\t{\"name\": \"%s\", \"median_ms\": %.3f, \"operations\": %ld, \"operations_per_second\": %.0f, \"peak_rss_kb\": %ld}",
+		         i ? "," : "", name.c_str(), median, ops, ops / (median / 1000.0), rss);
+		std::cout << buf;
+	}
+	std::cout << "\n\t]\n}\n";
+	
+	return 0;
+}
+
+// runs `ematrm` on `path` in batch mode, reading from the benchmark's input
+// file if it has one and discarding its output. with `profile` set, the
+// profile it prints is left in `err_out`.
+static bool
+run(char const *ematrm, std::string const &path, bool profile, sample &sample, std::string &err_out)
+{
+	int err_pipe[2];
+	if (pipe(err_pipe))
+		return false;
+	
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	else if (pid == 0) {
+		int in = open(input_path(path).c_str(), O_RDONLY);
+		if (in < 0)
+			in = open("/dev/null", O_RDONLY);
+		int out = open("/dev/null", O_WRONLY);
+		dup2(in, 0);
+		dup2(out, 1);
+		dup2(err_pipe[1], 2);
+		close(err_pipe[0]);
+		
+		if (profile)
+			execl(ematrm, ematrm, "--batch", "--profile", path.c_str(), nullptr);
+		else
+			execl(ematrm, ematrm, "--batch", path.c_str(), nullptr);
+		_exit(127);
+	}
+	
+	close(err_pipe[1]);
+	err_out.clear();
+	char buf[4096];
+	for (ssize_t n; (n = read(err_pipe[0], buf, sizeof(buf))) > 0;)
+		err_out.append(buf, n);
+	close(err_pipe[0]);
+	
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0)
+		return false;
+	std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+	
+	sample.ms = took.count();
+	sample.rss = usage.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// finds the source operations executed in a profile printed by `--profile`.
+static long
+count_ops(std::string const &report)
+{
+	size_t end = report.rfind(" source operations executed\n");
+	if (end == std::string::npos)
+		return 0;
+	size_t start = report.rfind('\n', end);
+	return atol(report.c_str() + (start == std::string::npos ? 0 : start + 1));
+}
+
+// the input of `bench/<name>.emat` is read from `bench/<name>.in`.
+static std::string
+input_path(std::string const &path)
+{
+	return path.substr(0, path.rfind('.')) + ".in";
+}
@@ -1,15 +1,70 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <csignal>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
-#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <sstream>
-#include <stack>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "ematrm.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#define VEC_X86
+#endif
+
+// native code generation for `--jit`, assuming the system v calling convention.
+#if defined(__x86_64__) && defined(__unix__) && !defined(NO_JIT)
+#include <sys/mman.h>
+#define JIT_X86
+#endif
+
+// program output, and input in `--batch` mode, go straight to the file
+// descriptors where possible and through stdio otherwise. source files are
+// mapped into memory rather than read.
+#if __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define POSIX_IO
+#endif
+
+// dispatch through a table of handler addresses rather than a `switch`, where
+// the compiler supports labels as values.
+#if defined(__GNUC__) && !defined(NO_THREADED)
+#define THREADED_DISPATCH
+#endif
+
 #define REG_STR_SIZE 38
+#define OUT_BUF_SIZE 65536
+#define IN_BUF_SIZE 65536
+#define LEX_CHUNK_MIN (1 << 20)
+#define TRACE_RING_SIZE (1 << 20)
+#define TRACE_CHUNK (1 << 14)
+#define IMAGE_FORMAT 4
+#define STACK_RESERVE_MAX (1 << 16)
 
 enum token_type {
 	// atoms.
@@ -83,960 +138,5092 @@ enum token_type {
 	TT_NOT,
 };
 
+// compiled instruction opcodes. the ones corresponding to tokens mirror
+// `token_type` exactly so that compiling those is a plain cast.
+enum opcode : uint8_t {
+	// atoms.
+	OP_LIT_STR = TT_LIT_STR,
+	OP_LIT_CH = TT_LIT_CH,
+	OP_LIT_NUM = TT_LIT_NUM,
+	
+	// register mask settings.
+	OP_TOGGLE_BIT_0 = TT_TOGGLE_BIT_0,
+	OP_TOGGLE_BIT_1 = TT_TOGGLE_BIT_1,
+	OP_TOGGLE_BIT_2 = TT_TOGGLE_BIT_2,
+	OP_TOGGLE_BIT_3 = TT_TOGGLE_BIT_3,
+	OP_TOGGLE_BIT_4 = TT_TOGGLE_BIT_4,
+	OP_TOGGLE_BIT_5 = TT_TOGGLE_BIT_5,
+	OP_TOGGLE_BIT_6 = TT_TOGGLE_BIT_6,
+	OP_TOGGLE_BIT_7 = TT_TOGGLE_BIT_7,
+	OP_TOGGLE_BIT_8 = TT_TOGGLE_BIT_8,
+	OP_TOGGLE_BIT_9 = TT_TOGGLE_BIT_9,
+	OP_TOGGLE_BIT_A = TT_TOGGLE_BIT_A,
+	OP_TOGGLE_BIT_B = TT_TOGGLE_BIT_B,
+	OP_TOGGLE_BIT_C = TT_TOGGLE_BIT_C,
+	OP_TOGGLE_BIT_D = TT_TOGGLE_BIT_D,
+	OP_TOGGLE_BIT_E = TT_TOGGLE_BIT_E,
+	OP_TOGGLE_BIT_F = TT_TOGGLE_BIT_F,
+	OP_TOGGLE_COL_0 = TT_TOGGLE_COL_0,
+	OP_TOGGLE_COL_1 = TT_TOGGLE_COL_1,
+	OP_TOGGLE_COL_2 = TT_TOGGLE_COL_2,
+	OP_TOGGLE_COL_3 = TT_TOGGLE_COL_3,
+	OP_TOGGLE_ROW_0 = TT_TOGGLE_ROW_0,
+	OP_TOGGLE_ROW_1 = TT_TOGGLE_ROW_1,
+	OP_TOGGLE_ROW_2 = TT_TOGGLE_ROW_2,
+	OP_TOGGLE_ROW_3 = TT_TOGGLE_ROW_3,
+	OP_TOGGLE_MAT = TT_TOGGLE_MAT,
+	
+	// operation mode settings.
+	OP_MODE_COL = TT_OP_MODE_COL,
+	OP_MODE_ROW = TT_OP_MODE_ROW,
+	OP_ORDER_REV = TT_OP_ORDER_REV,
+	
+	// operations.
+	OP_POP_ATOM = TT_POP_ATOM,
+	OP_PUSH_ATOM = TT_PUSH_ATOM,
+	OP_WRITE_STDOUT = TT_WRITE_STDOUT,
+	OP_WRITE_STDOUT_NEWLINE = TT_WRITE_STDOUT_NEWLINE,
+	OP_READ_STDIN = TT_READ_STDIN,
+	OP_STR_TO_INT = TT_STR_TO_INT,
+	OP_INT_TO_STR = TT_INT_TO_STR,
+	OP_ADD = TT_ADD,
+	OP_SUB = TT_SUB,
+	OP_MUL = TT_MUL,
+	OP_DIV = TT_DIV,
+	OP_NUM_ADD = TT_NUM_ADD,
+	OP_NUM_SUB = TT_NUM_SUB,
+	OP_NUM_MUL = TT_NUM_MUL,
+	OP_NUM_DIV = TT_NUM_DIV,
+	OP_IND_ADD = TT_IND_ADD,
+	OP_IND_SUB = TT_IND_SUB,
+	OP_IND_MUL = TT_IND_MUL,
+	OP_IND_DIV = TT_IND_DIV,
+	OP_POP_JMP = TT_POP_JMP,
+	OP_POP_JMP_COND = TT_POP_JMP_COND,
+	OP_PUSH_JMP = TT_PUSH_JMP,
+	OP_SAVE_JMP = TT_SAVE_JMP,
+	OP_EQUAL = TT_EQUAL,
+	OP_GREQUAL = TT_GREQUAL,
+	OP_GREATER = TT_GREATER,
+	OP_LESS = TT_LESS,
+	OP_LEQUAL = TT_LEQUAL,
+	OP_AND = TT_AND,
+	OP_OR = TT_OR,
+	OP_NOT = TT_NOT,
+	
+	// instructions not produced from tokens.
+	OP_XOR_MASK,
+	OP_POP_IMM,
+	OP_ADD_IMM,
+	OP_SUB_IMM,
+	OP_MUL_IMM,
+	OP_DIV_IMM,
+	OP_EQUAL_IMM,
+	OP_GREQUAL_IMM,
+	OP_GREATER_IMM,
+	OP_LESS_IMM,
+	OP_LEQUAL_IMM,
+	OP_PUSH_INTS,
+	OP_WRITE_INTS,
+	OP_WRITE_INTS_NEWLINE,
+	OP_NOP,
+	OP_SET_SEL,
+	OP_LOOP_HEAD,
+	OP_BRANCH,
+	OP_BRANCH_COND,
+	OP_HALT,
+};
+
 enum op_mode {
 	OM_ROW = 0,
 	OM_COL,
 };
 
-enum reg_type {
-	RT_STR = 0,
-	RT_INT,
+enum atom_type {
+	AT_INT = 0,
+	AT_CH,
+	AT_STR,
+	AT_REG_STR,
+};
+
+// integer register operations applied to all selected registers at once.
+enum vec_op {
+	VO_ADD = 0,
+	VO_SUB,
+	VO_MUL,
+	VO_EQUAL,
+	VO_GREQUAL,
+	VO_GREATER,
+	VO_LESS,
+	VO_LEQUAL,
+};
+
+// instrumentation compiled into an instance of `exec()`.
+enum exec_hook {
+	EH_NONE = 0,
+	EH_PROFILE,
+	EH_TRACE,
+	EH_SNAPSHOT,
+	EH_BUDGET,
+};
+
+// when buffered program output is written out, besides when the buffer is
+// full and on exit.
+enum flush_mode {
+	FM_LINE = 0,
+	FM_FULL,
+	FM_NONE,
+};
+
+// how the lexer treats each source character. characters from `LC_COL` on
+// are prefixes of two-character tokens.
+enum lex_class {
+	LC_INVALID = 0,
+	LC_SPACE,
+	LC_NEWLINE,
+	LC_SINGLE,
+	LC_STRING,
+	LC_CHAR,
+	LC_NUM,
+	LC_COL,
+	LC_ROW,
+	LC_NUM_OP,
+	LC_IND_OP,
+	LC_JMP_OP,
+	LC_BOOL_OP,
 };
 
+// `data` points into the source text, which outlives the tokens.
 struct token {
 	token_type type;
-	std::string data;
+	std::string_view data;
 	long line;
 };
 
-struct reg {
-	reg_type type;
-	union {
-		char str[REG_STR_SIZE];
-		long num;
-	} data;
+// the tokens starting in part of the source. `starts` holds the offset of
+// each token, followed by that of the malformed token `err` describes if
+// lexing stopped early. `end` and `line` are the position and line where
+// lexing stopped.
+struct lex_chunk {
+	std::vector<token> toks;
+	std::vector<size_t> starts;
+	size_t end;
+	unsigned line;
+	char const *err = nullptr;
+	unsigned err_line;
+};
+
+// `type` is the token produced for `LC_SINGLE` characters.
+struct lex_entry {
+	lex_class cls;
+	token_type type;
+};
+
+// the `n`th character of `suffixes` following a prefix gives the token
+// `first + n`.
+struct lex_prefix {
+	char const *suffixes;
+	token_type first;
+	char const *missing;
+	char const *invalid;
+};
+
+// a compiled instruction. the meaning of `arg` depends on `op`: parsed value
+// for numeric literals and immediate operators, character for character
+// literals, literal pool index for string literals, the bits to flip for mask
+// toggles, the unoptimized instruction index for `.` and loop heads, the loop
+// head index for branches and the selection pool index for `OP_SET_SEL`.
+struct instr {
+	opcode op;
+	int32_t arg;
+};
+
+// a mask, mode and order known ahead of time, along with the registers they
+// select as `update_order()` would find them.
+struct reg_sel {
+	uint16_t mask;
+	op_mode mode;
+	bool rev;
+	uint8_t order_len;
+	uint8_t order[16];
+	long positions[16];
+};
+
+struct program {
+	// instructions, terminated by an `OP_HALT` which is not counted as part
+	// of the program for the purposes of jumping.
+	std::vector<instr> code;
+	
+	// string literal pool, shared by all instructions referencing equal
+	// literals. `str_nums` holds the numeric value of each literal.
+	std::vector<std::string> strs;
+	std::vector<long> str_nums;
+	
+	// source line of each instruction in `code`.
+	std::vector<long> lines;
+	
+	// instruction each unoptimized instruction index is executed as, so
+	// that jumps keep landing on the same logical instruction. the last
+	// entry is for the terminating `OP_HALT`.
+	std::vector<int32_t> remap;
+	
+	// selection pool, shared by all `OP_SET_SEL` instructions selecting
+	// the same registers in the same order.
+	std::vector<reg_sel> sels;
+	
+	// hash of the source the program was compiled from, under which its
+	// image is cached.
+	uint64_t src_hash = 0;
+	
+	// initial capacities of the atom and jump stacks and of the string
+	// arena of machines running the program, from `size_stacks()` or the
+	// image the program was loaded from.
+	size_t atoms_reserve = 0;
+	size_t jumps_reserve = 0;
+	size_t arena_reserve = 0;
+};
+
+// a value on the atom stack. `num` is the numeric value operators consume,
+// computed once when the atom is created rather than on every use. `ref` is
+// the character for `AT_CH`, the literal pool index for `AT_STR` and the
+// offset into `machine::str_arena` for `AT_REG_STR`.
+struct atom {
+	atom_type type;
+	int32_t ref;
+	long num;
+};
+
+// the register file is laid out by field so that integer registers can be
+// operated on as vectors. bit `i` of `ints` is set when register `i` holds an
+// integer, in which case `nums[i]` is its value; otherwise `strs[i]` is. a
+// string is `lens[i]` bytes long, without null bytes, and followed by zeroes
+// up to `REG_STR_SIZE`, so that strings are copied and compared whole.
+struct reg_file {
+	alignas(64) long nums[16];
+	uint16_t ints;
+	uint8_t lens[16];
+	char strs[16][REG_STR_SIZE];
+};
+
+// statically known mask, mode and order before an instruction. `known` is
+// unset if the instruction can be reached with differing states. registers
+// with their bit set in `ints` or `strs` are known to hold integers or strings
+// whatever the mask, and `top` is the type of the atom on top of the stack, if
+// known.
+struct flow_state {
+	bool reached;
+	bool known;
+	uint16_t mask;
+	op_mode mode;
+	bool rev;
+	uint16_t ints;
+	uint16_t strs;
+	std::optional<atom_type> top;
+};
+
+// buffered program output, written to `fd` or passed to `write` in chunks of
+// up to `OUT_BUF_SIZE` bytes. `len` bytes of `buf` are pending. without
+// either, output is kept in `buf` as a whole instead.
+struct out_sink {
+	int fd;
+	ematrm_write_fn write;
+	void *write_ctx;
+	flush_mode mode;
+	std::vector<char> buf;
+	size_t len;
+};
+
+// program input in `--batch` mode. `data` holds `len` bytes of which the
+// first `pos` have been consumed. it points either into `buf`, which is
+// refilled from `fd` or by `read` as needed, to the whole of `fd` mapped into
+// memory, or, without either, to all of the input already in memory.
+struct in_source {
+	bool batch;
+	int fd;
+	ematrm_read_fn read;
+	void *read_ctx;
+	bool mapped;
+	char const *data;
+	size_t pos;
+	size_t len;
+	std::vector<char> buf;
+};
+
+// a program run by `--run-many`, reading from and writing to files of its
+// own, and how long it took.
+struct job {
+	size_t prog;
+	std::string in_path;
+	std::string out_path;
+	bool ok;
+	double ms;
+};
+
+// tasks yet to be run by one thread of a pool. the owner takes them from the
+// front, and other threads steal from the back once out of their own.
+struct task_queue {
+	std::mutex lock;
+	std::deque<size_t> tasks;
+};
+
+// gathered with `--profile`. `counts` and `regs` hold, for each instruction,
+// how often it ran and the number of registers selected when it did. time is
+// only measured when `timed` is set, and then only around input and output.
+struct profile {
+	std::vector<uint64_t> counts;
+	std::vector<uint64_t> regs;
+	bool timed;
+	std::chrono::steady_clock::duration io_time;
+	std::chrono::steady_clock::duration total_time;
+};
+
+// one executed instruction, as recorded with `--trace`. `instr_ptr` is the
+// index of the instruction, and the rest is the state right before it ran.
+struct trace_rec {
+	uint32_t instr_ptr;
+	uint8_t op;
+	uint8_t pad;
+	uint16_t mask;
+	uint32_t atoms;
+	uint32_t jumps;
+};
+
+// the header of a trace file, followed by its records. `prog_hash` ties the
+// trace to the program it was recorded from.
+struct trace_header {
+	char magic[8];
+	uint64_t prog_hash;
+};
+
+// the header of a compiled program image, written by `--compile` and to the
+// cache. it is followed by `code_len` instructions and as many lines,
+// `strs_len` numeric values of string literals, `remap_len` remapped indices,
+// `sels_len` known selections, `strs_len` literal lengths, and `chars_len`
+// bytes of the literals
+// themselves. images hold no pointers, and are only read by builds of the
+// same `version`. the stack reserves are stored so that loading an image never
+// needs `size_stacks()`.
+struct image_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t src_hash;
+	uint64_t code_len;
+	uint64_t strs_len;
+	uint64_t remap_len;
+	uint64_t chars_len;
+	uint64_t sels_len;
+	uint64_t atoms_reserve;
+	uint64_t jumps_reserve;
+	uint64_t arena_reserve;
+};
+
+// a known selection as stored in an image, without the registers it selects,
+// which are listed anew on loading.
+struct image_sel {
+	uint16_t mask;
+	uint8_t mode;
+	uint8_t rev;
+};
+
+// records in flight from the interpreter to the thread writing them out.
+// `head` records have been published and `tail` written, both counting from
+// the start. the interpreter fills up to `limit` before publishing, so that
+// it only synchronizes once every `TRACE_CHUNK` records.
+struct trace_ring {
+	std::vector<trace_rec> recs;
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+	std::atomic<bool> done;
+	uint64_t local_head;
+	uint64_t limit;
+	FILE *file;
+	bool failed;
+	std::thread writer;
+};
+
+// the fixed part of a snapshot file. it is followed by the register file,
+// `atoms` atoms and `jumps` jump addresses, each bottom first, and
+// `arena_len` bytes of `machine::str_arena`.
+struct snapshot_header {
+	char magic[8];
+	uint64_t prog_hash;
+	uint64_t instr_ptr;
+	uint16_t mask;
+	uint8_t mode;
+	uint8_t rev;
+	uint32_t pad;
+	uint64_t atoms;
+	uint64_t jumps;
+	uint64_t arena_len;
+};
+
+// when to snapshot the machine, with `--snapshot`. `left` counts down the
+// instructions until the next one, if taken every `every` instructions.
+// `child` is the process still writing the last one, if any.
+struct snapshotter {
+	char const *path;
+	uint64_t every;
+	uint64_t left;
+	long child;
+	bool failed;
 };
 
 struct machine {
-	reg regs[16];
+	reg_file regs;
 	
 	uint16_t mask;
 	size_t instr_ptr;
 	op_mode mode;
 	bool rev;
 	
-	std::stack<token> atoms;
-	std::stack<long> jumps;
+	// registers selected by `mask`, in the order given by `mode` and `rev`.
+	// this is only recomputed after one of those has changed.
+	// `positions` holds the index of each selected register within `order`.
+	uint8_t order[16];
+	uint8_t order_len;
+	bool order_dirty;
+	long positions[16];
+	
+	// both stacks are contiguous and never shrink, and neither does the
+	// arena of null-terminated strings of `AT_REG_STR` atoms, which is cut
+	// back as they are popped. a balanced loop allocates nothing once warm.
+	std::vector<atom> atoms;
+	std::vector<long> jumps;
+	std::vector<char> str_arena;
+	
+	out_sink out;
+	in_source in;
+	
+	// null unless profiling, tracing or taking snapshots respectively.
+	profile *prof;
+	trace_ring *trace;
+	snapshotter *snap;
+	
+	// instructions left to run when given a budget.
+	uint64_t budget;
 };
 
-static void err(std::string const &msg);
-static void prog_err(unsigned line, std::string const &msg);
-static std::string read_file(std::ifstream &f);
-static std::optional<token> lex_string(std::string const &src, size_t &i, unsigned &line);
-static std::optional<token> lex_char(std::string const &src, size_t &i, unsigned &line);
-static std::optional<token> lex_num(std::string const &src, size_t &i, unsigned &line);
-static std::optional<std::vector<token>> lex(std::string const &src);
-static void for_each_reg(machine &machine, std::function<void(reg &)> const &fn);
-static void exec_cycle(machine &machine, std::vector<token> const &code);
+// the handles of the library interface.
+struct ematrm_program {
+	program prog;
+};
 
-int
-main(int argc, char const *argv[])
-{
-	if (argc != 2) {
-		std::cerr << "usage: " << argv[0] << " <file>\n";
-		return 1;
-	}
+struct ematrm_machine {
+	machine state;
+};
+
+using vec_fn = void (*)(vec_op op, long *nums, uint16_t mask, long const *opnds);
+
+// visiting order of all registers for each `mode` and `rev`.
+static uint8_t const reg_orders[2][2][16] = {
+	// OM_ROW.
+	{
+		{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+		{3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+	},
+	// OM_COL.
+	{
+		{0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15},
+		{12, 8, 4, 0, 13, 9, 5, 1, 14, 10, 6, 2, 15, 11, 7, 3},
+	},
+};
+
+// operators with a variant taking an immediate operand in place of a numeric
+// literal pushed right before.
+static std::pair<opcode, opcode> const imm_ops[] = {
+	{OP_POP_ATOM, OP_POP_IMM},
+	{OP_ADD, OP_ADD_IMM},
+	{OP_SUB, OP_SUB_IMM},
+	{OP_MUL, OP_MUL_IMM},
+	{OP_DIV, OP_DIV_IMM},
+	{OP_EQUAL, OP_EQUAL_IMM},
+	{OP_GREQUAL, OP_GREQUAL_IMM},
+	{OP_GREATER, OP_GREATER_IMM},
+	{OP_LESS, OP_LESS_IMM},
+	{OP_LEQUAL, OP_LEQUAL_IMM},
+};
+
+// how each opcode is shown in profiles: the tokens it was compiled from, where
+// `n` stands for an immediate operand.
+static char const *const op_names[] = {
+	"\"...\"", "'c", "$n$",
+	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "a", "b", "c", "d", "e", "f",
+	"|0", "|1", "|2", "|3", "`0", "`1", "`2", "`3", "A",
+	"C", "R", "~",
+	">", "<", "w", "W", "r", "#", ",", "+", "-", "*", "/",
+	"%+", "%-", "%*", "%/", "[+", "[-", "[*", "[/",
+	"j>", "j?", "j<", ".",
+	"=", "F", "G", "L", "M", "&", "?|", "!",
+	"mask toggles", "$n$>", "$n$+", "$n$-", "$n$*", "$n$/", "$n$=", "$n$F", "$n$G", "$n$L", "$n$M",
+	"< (ints)", "w (ints)", "W (ints)", "# or , (no-op)", "known selection",
+	". (loop)", "j> (loop)", "j? (loop)", "end",
+};
+static_assert(sizeof(op_names) / sizeof(op_names[0]) == OP_HALT + 1);
+
+// lexer character classes, indexed by character.
+static constexpr std::array<lex_entry, 256> lex_table = [] {
+	std::array<lex_entry, 256> table{};
 	
-	std::ifstream f{argv[1], std::ios::binary};
-	if (!f) {
-		err("failed to open file!");
-		return 1;
-	}
+	for (char ch : {' ', '\t', '\v', '\f', '\r'})
+		table[ch] = {LC_SPACE, TT_LIT_STR};
+	table['\n'] = {LC_NEWLINE, TT_LIT_STR};
+	table['"'] = {LC_STRING, TT_LIT_STR};
+	table['\''] = {LC_CHAR, TT_LIT_CH};
+	table['$'] = {LC_NUM, TT_LIT_NUM};
+	table['|'] = {LC_COL, TT_TOGGLE_COL_0};
+	table['`'] = {LC_ROW, TT_TOGGLE_ROW_0};
+	table['%'] = {LC_NUM_OP, TT_NUM_ADD};
+	table['['] = {LC_IND_OP, TT_IND_ADD};
+	table['j'] = {LC_JMP_OP, TT_POP_JMP};
+	table['?'] = {LC_BOOL_OP, TT_OR};
 	
-	std::string src = read_file(f);
-	std::optional<std::vector<token>> code = lex(src);
-	if (!code) {
-		err("failed to lex file!");
-		return 1;
-	}
+	char const *bits = "0123456789abcdef";
+	for (int i = 0; bits[i]; ++i)
+		table[bits[i]] = {LC_SINGLE, static_cast<token_type>(TT_TOGGLE_BIT_0 + i)};
 	
-	machine machine = {
-		.mask = 0x0,
-		.instr_ptr = 0,
-		.mode = OM_ROW,
-		.rev = false,
-		.atoms = std::stack<token>{},
-		.jumps = std::stack<long>{},
+	std::pair<char, token_type> const singles[] = {
+		{'A', TT_TOGGLE_MAT},
+		{'C', TT_OP_MODE_COL},
+		{'R', TT_OP_MODE_ROW},
+		{'~', TT_OP_ORDER_REV},
+		{'>', TT_POP_ATOM},
+		{'<', TT_PUSH_ATOM},
+		{'w', TT_WRITE_STDOUT},
+		{'W', TT_WRITE_STDOUT_NEWLINE},
+		{'r', TT_READ_STDIN},
+		{'#', TT_STR_TO_INT},
+		{',', TT_INT_TO_STR},
+		{'+', TT_ADD},
+		{'-', TT_SUB},
+		{'*', TT_MUL},
+		{'/', TT_DIV},
+		{'.', TT_SAVE_JMP},
+		{'=', TT_EQUAL},
+		{'F', TT_GREQUAL},
+		{'G', TT_GREATER},
+		{'L', TT_LESS},
+		{'M', TT_LEQUAL},
+		{'&', TT_AND},
+		{'!', TT_NOT},
 	};
-	while (machine.instr_ptr < code->size())
-		exec_cycle(machine, *code);
+	for (auto [ch, type] : singles)
+		table[ch] = {LC_SINGLE, type};
 	
-	return 0;
+	return table;
+}();
+
+// two-character tokens, indexed by `lex_class` starting at `LC_COL`.
+static lex_prefix const lex_prefixes[] = {
+	{"0123", TT_TOGGLE_COL_0, "expected column number after '|'!", "invalid column number!"},
+	{"0123", TT_TOGGLE_ROW_0, "expected row number after '`'!", "invalid row number!"},
+	{"+-*/", TT_NUM_ADD, "expected register number operator after '%'!", "invalid register number operator!"},
+	{"+-*/", TT_IND_ADD, "expected register index operator after '['!", "invalid register index operator!"},
+	{">?<", TT_POP_JMP, "expected jump stack operator after 'j'!", "invalid jump stack operator!"},
+	{"|", TT_OR, "expected '|' after '?'!", "invalid boolean operator!"},
+};
+
+// constant operand vectors.
+static long const reg_nums[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+static long const reg_zeros[16] = {0};
+
+#ifndef EMATRM_LIB
+// heap allocations made so far by the whole process, for `--stats`. they are
+// only counted while `count_allocs` is set, so that threads allocating without
+// `--stats` never contend for `heap_allocs`.
+static std::atomic<bool> count_allocs;
+static std::atomic<uint64_t> heap_allocs;
+#endif
+
+// support code shared by every program translated with `--emit-cpp`. the
+// machine state lives in globals, mirroring `machine` and `reg_file`.
+static char const cpp_runtime[] = R"(#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define REG_STR_SIZE 38
+
+enum atom_type {
+	AT_INT = 0,
+	AT_CH,
+	AT_STR,
+	AT_REG_STR,
+};
+
+struct atom {
+	atom_type type;
+	int32_t ref;
+	long num;
+};
+
+struct reg_range {
+	uint8_t const *first, *last;
+	
+	uint8_t const *begin(void) const { return first; }
+	uint8_t const *end(void) const { return last; }
+};
+
+static uint8_t const reg_orders[2][2][16] = {
+	{
+		{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+		{3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
+	},
+	{
+		{0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15},
+		{12, 8, 4, 0, 13, 9, 5, 1, 14, 10, 6, 2, 15, 11, 7, 3},
+	},
+};
+
+static long nums[16];
+static uint16_t ints;
+static char strs[16][REG_STR_SIZE];
+
+static uint16_t mask;
+static int mode;
+static bool rev;
+
+static uint8_t order[16];
+static uint8_t order_len;
+static bool order_dirty;
+
+static std::vector<atom> atoms;
+static std::vector<long> jumps;
+static std::vector<char> str_arena;
+
+extern char const *const lits[];
+
+static inline reg_range
+sel(void)
+{
+	if (order_dirty) {
+		order_len = 0;
+		for (uint8_t r : reg_orders[mode][rev]) {
+			if (mask & 1 << r)
+				order[order_len++] = r;
+		}
+		order_dirty = false;
+	}
+	return {order, order + order_len};
 }
 
-static void
-err(std::string const &msg)
+static inline bool
+is_int(int r)
 {
-	std::cerr << "err: " << msg << '\n';
+	return ints >> r & 1;
 }
 
-static void
-prog_err(unsigned line, std::string const &msg)
+static inline long
+wrap_add(long a, long b)
 {
-	std::cerr << '[' << line << "] err: " << msg << '\n';
+	return static_cast<unsigned long>(a) + static_cast<unsigned long>(b);
 }
 
-static std::string
-read_file(std::ifstream &f)
+static inline long
+wrap_sub(long a, long b)
 {
-	std::ostringstream ss;
-	ss << f.rdbuf();
-	return ss.str();
+	return static_cast<unsigned long>(a) - static_cast<unsigned long>(b);
 }
 
-static std::optional<token>
-lex_string(std::string const &src, size_t &i, unsigned &line)
+static inline long
+wrap_mul(long a, long b)
 {
-	unsigned line_start = line;
-	std::string data = "";
-	
-	while (i < src.length()) {
-		if (src[i] == '\n')
-			++line;
-		else if (src[i] == '"')
-			break;
-		data += src[i];
-		++i;
-	}
-	
-	if (i == src.length()) {
-		prog_err(line_start, "unterminated string!");
-		return std::nullopt;
+	return static_cast<unsigned long>(a) * static_cast<unsigned long>(b);
+}
+
+static inline char const *
+atom_str(atom const &a)
+{
+	return a.type == AT_STR ? lits[a.ref] : &str_arena[a.ref];
+}
+
+static inline void
+push(atom_type type, int32_t ref, long num)
+{
+	atoms.push_back({type, ref, num});
+}
+
+static inline void
+drop(void)
+{
+	if (atoms.back().type == AT_REG_STR)
+		str_arena.resize(atoms.back().ref);
+	atoms.pop_back();
+}
+
+static inline bool
+pop_num(long &num)
+{
+	if (atoms.empty())
+		return false;
+	num = atoms.back().num;
+	drop();
+	return true;
+}
+
+static inline void
+push_reg(int r)
+{
+	if (is_int(r)) {
+		push(AT_INT, 0, static_cast<int>(nums[r]));
+		return;
 	}
 	
-	token tok = {
-		.type = TT_LIT_STR,
-		.data = data,
-		.line = line_start,
-	};
-	
-	return tok;
+	size_t len = strnlen(strs[r], REG_STR_SIZE);
+	int32_t ref = str_arena.size();
+	str_arena.insert(str_arena.end(), strs[r], strs[r] + len);
+	str_arena.push_back(0);
+	push(AT_REG_STR, ref, atoi(&str_arena[ref]));
 }
 
-static std::optional<token>
-lex_char(std::string const &src, size_t &i, unsigned &line)
+static inline void
+write_reg(int r, bool newline)
 {
-	if (i == src.length()) {
-		prog_err(line, "non-existent character!");
-		return std::nullopt;
+	if (is_int(r))
+		std::cout << nums[r];
+	else {
+		char buf[REG_STR_SIZE + 1] = {0};
+		strncpy(buf, strs[r], REG_STR_SIZE);
+		std::cout << buf;
 	}
-	
-	token tok = {
-		.type = TT_LIT_CH,
-		.data = std::string{src[i]},
-		.line = line,
-	};
-	
-	if (src[i] == '\n')
-		++line;
-	
-	return tok;
+	if (newline)
+		std::cout << '\n';
 }
 
-static std::optional<token>
-lex_num(std::string const &src, size_t &i, unsigned &line)
+static inline std::string
+read_input(void)
+{
+	std::string input;
+	std::cout << ">: ";
+	std::cin >> input;
+	return input;
+}
+
+static inline void
+str_to_int(int r)
+{
+	if (is_int(r))
+		return;
+	char buf[REG_STR_SIZE + 1] = {0};
+	strncpy(buf, strs[r], REG_STR_SIZE);
+	nums[r] = atoi(buf);
+}
+
+static inline void
+int_to_str(int r)
+{
+	if (is_int(r))
+		strncpy(strs[r], std::to_string(nums[r]).c_str(), REG_STR_SIZE);
+}
+
+static inline void
+str_equal(int r, char const *str)
+{
+	if (is_int(r))
+		return;
+	char buf[REG_STR_SIZE + 1] = {0};
+	strncpy(buf, strs[r], REG_STR_SIZE);
+	nums[r] = !strcmp(buf, str);
+}
+
+)";
+
+// those only called from `main()` are marked as possibly unused, since the
+// library is built without it.
+static void err(std::string const &msg);
+static void prog_err(unsigned line, std::string const &msg);
+static std::string prog_err_msg(unsigned line, std::string const &msg);
+static std::string read_file(std::ifstream &f);
+static std::optional<std::string_view> map_file(char const *path, std::string &buf);
+static size_t scan_space(std::string_view src, size_t i, unsigned &line);
+static size_t scan_byte(std::string_view src, size_t i, char ch, unsigned &line);
+static size_t scan_digits(std::string_view src, size_t i);
+static std::optional<token> lex_string(std::string_view src, size_t &i, unsigned &line, char const *&err);
+static std::optional<token> lex_char(std::string_view src, size_t &i, unsigned &line, char const *&err);
+static std::optional<token> lex_num(std::string_view src, size_t &i, unsigned &line, char const *&err);
+static std::optional<token> lex_token(std::string_view src, size_t &i, unsigned &line, char const *&err);
+static void lex_range(std::string_view src, size_t begin, size_t end, unsigned line, lex_chunk &chunk);
+static std::optional<std::vector<token>> lex(std::string_view src, std::string &error);
+static std::optional<std::vector<token>> lex_parallel(std::string_view src, size_t nchunks, std::string &error);
+static program compile(std::vector<token> const &toks);
+static std::optional<program> load_program(char const *path, char const *cache_dir);
+static uint64_t hash_bytes(uint64_t hash, void const *data, size_t len);
+static uint64_t image_version(void);
+static bool is_image(std::string_view data);
+static size_t array_size(uint64_t len, size_t size);
+static std::optional<program> read_image(std::string_view data, std::string &error);
+static bool write_image(program const &prog, char const *path);
+static void optimize(program &prog);
+static uint8_t order_regs(uint16_t mask, op_mode mode, bool rev, uint8_t *order, long *positions);
+static void update_order(machine &machine);
+template<typename F> static void for_each_reg(machine &machine, F const &fn);
+static char const *atom_str(machine const &machine, program const &prog, atom const &atom);
+static void pop_atom(machine &machine);
+static long const *order_positions(machine &machine);
+static size_t pad_str(char const *str, char *padded);
+static uint16_t match_strs(reg_file const &regs, char const *padded, size_t len);
+static long parse_int(char const *str, size_t len);
+static void sink_flush(out_sink &out);
+static void sink_write(out_sink &out, char const *data, size_t len);
+static void sink_num(out_sink &out, long num);
+static void source_open(in_source &in, int fd);
+static bool source_fill(in_source &in);
+static void source_word(in_source &in, char *word);
+static void source_view(in_source &in, std::string_view data);
+static void source_close(in_source &in);
+static void vec_apply_scalar(vec_op op, long *nums, uint16_t mask, long const *opnds);
+#ifdef VEC_X86
+static void vec_apply_avx2(vec_op op, long *nums, uint16_t mask, long const *opnds);
+static void vec_apply_avx512(vec_op op, long *nums, uint16_t mask, long const *opnds);
+#endif
+static vec_fn vec_select(void);
+static void vec_apply(machine &machine, vec_op op, long const *opnds);
+static void vec_apply_val(machine &machine, vec_op op, long val);
+static void prof_count(machine &machine, program const &prog);
+static std::chrono::steady_clock::time_point prof_now(machine const &machine);
+static void prof_io(machine &machine, std::chrono::steady_clock::time_point start);
+[[maybe_unused]] static bool trace_open(trace_ring &ring, char const *path, program const &prog);
+static void trace_step(machine &machine, program const &prog);
+static void trace_reserve(trace_ring &ring);
+static void trace_drain(trace_ring &ring);
+[[maybe_unused]] static bool trace_close(trace_ring &ring);
+[[maybe_unused]] static bool decode_trace(char const *path, program const &prog, std::string_view src);
+[[maybe_unused]] static void snapshot_signal(int sig);
+static void snapshot_step(machine &machine, program const &prog);
+static void snapshot_take(machine &machine, program const &prog);
+static bool snapshot_reap(snapshotter &snap, bool wait);
+static bool snapshot_write(machine const &machine, program const &prog, char const *path);
+[[maybe_unused]] static bool snapshot_read(machine &machine, program const &prog, char const *path);
+template<bool STEP, exec_hook HOOK = EH_NONE> static void exec(machine &machine, program const &prog);
+static std::vector<int32_t> pair_loops(program const &prog);
+static void resolve_loops(program &prog);
+static void size_stacks(program &prog);
+static void reserve_stacks(machine &machine, program const &prog);
+static bool join_flow(flow_state &dst, flow_state const &src);
+static std::vector<flow_state> analyze_flow(program const &prog);
+static bool sel_typed(flow_state const &state, uint16_t types);
+static void specialize_types(program &prog);
+static void specialize_sels(program &prog);
+#ifdef JIT_X86
+static void emit(std::vector<uint8_t> &buf, std::initializer_list<uint8_t> bytes);
+static void emit16(std::vector<uint8_t> &buf, uint16_t val);
+static void emit32(std::vector<uint8_t> &buf, uint32_t val);
+static void emit64(std::vector<uint8_t> &buf, uint64_t val);
+static void jit_step(machine *machine, program const *prog);
+static int jit_pop_cond(machine *machine);
+static void jit_push_jmp(machine *machine, long jmp);
+static bool jit_inline_op(std::vector<uint8_t> &buf, machine const &machine, flow_state const &state, opcode op, std::optional<long> lit);
+static bool jit_exec(machine &machine, program const &prog);
+#endif
+[[maybe_unused]] static void emit_cpp(std::ostream &out, program const &prog);
+static machine new_machine(flush_mode flush, bool batch, int in_fd, int out_fd);
+static void reset_machine(machine &machine);
+static void run(machine &machine, program const &prog, bool jit);
+static bool touches_regs(opcode op);
+[[maybe_unused]] static void print_profile(std::ostream &out, program const &prog, profile const &prof, std::string_view src);
+[[maybe_unused]] static void print_stats(std::ostream &out, machine const &machine, program const &prog, uint64_t allocs);
+static uint64_t program_hash(program const &prog);
+template<typename F> static void run_pool(size_t ntasks, unsigned nthreads, F const &fn);
+#ifdef POSIX_IO
+[[maybe_unused]] static bool run_many(char const *path, unsigned nthreads, bool jit, flush_mode flush, char const *cache_dir);
+[[maybe_unused]] static bool run_each(char const *path, char const *list_path, char const *out_dir, unsigned nthreads, bool jit, flush_mode flush, char const *cache_dir);
+#endif
+
+#ifndef EMATRM_LIB
+int
+main(int argc, char const *argv[])
 {
-	std::string data = "";
+	char const *path = nullptr, *jobs_path = nullptr, *list_path = nullptr, *out_dir = nullptr;
+	char const *trace_path = nullptr, *decode_path = nullptr, *snap_path = nullptr, *resume_path = nullptr;
+	char const *image_path = nullptr, *cache_dir = nullptr;
+	uint64_t snap_every = 0;
+	bool jit = false, emit = false, batch = false, each_line = false, profiling = false, timed = false, stats = false;
+	unsigned nthreads = std::max(std::thread::hardware_concurrency(), 1u);
 	
-	while (i < src.length()) {
-		if (src[i] == '$')
+	// like stdio, output is line buffered only when interactive by default.
+	flush_mode flush = FM_LINE;
+#ifdef POSIX_IO
+	if (!isatty(STDOUT_FILENO))
+		flush = FM_FULL;
+#endif
+	
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--jit"))
+			jit = true;
+		else if (!strcmp(argv[i], "--flush=line"))
+			flush = FM_LINE;
+		else if (!strcmp(argv[i], "--flush=full"))
+			flush = FM_FULL;
+		else if (!strcmp(argv[i], "--flush=none"))
+			flush = FM_NONE;
+		else if (!strcmp(argv[i], "--emit-cpp"))
+			emit = true;
+		else if (!strcmp(argv[i], "--batch"))
+			batch = true;
+		else if (!strcmp(argv[i], "--run-many") && i + 1 < argc && !jobs_path)
+			jobs_path = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			nthreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--profile"))
+			profiling = true;
+		else if (!strcmp(argv[i], "--profile=time"))
+			profiling = timed = true;
+		else if (!strcmp(argv[i], "--stats"))
+			stats = true;
+		else if (!strncmp(argv[i], "--trace=", 8) && argv[i][8])
+			trace_path = argv[i] + 8;
+		else if (!strncmp(argv[i], "--decode-trace=", 15) && argv[i][15])
+			decode_path = argv[i] + 15;
+		else if (!strncmp(argv[i], "--snapshot=", 11) && argv[i][11])
+			snap_path = argv[i] + 11;
+		else if (!strncmp(argv[i], "--snapshot-every=", 17) && atoll(argv[i] + 17) > 0)
+			snap_every = atoll(argv[i] + 17);
+		else if (!strncmp(argv[i], "--resume=", 9) && argv[i][9])
+			resume_path = argv[i] + 9;
+		else if (!strcmp(argv[i], "--compile") && i + 3 < argc && !strcmp(argv[i + 2], "-o") && !path && !image_path) {
+			path = argv[++i];
+			image_path = argv[i += 2];
+		} else if (!strncmp(argv[i], "--cache=", 8) && argv[i][8])
+			cache_dir = argv[i] + 8;
+		else if (!strcmp(argv[i], "--each-line"))
+			each_line = true;
+		else if (!strcmp(argv[i], "--each-file") && i + 1 < argc && !list_path)
+			list_path = argv[++i];
+		else if (!strncmp(argv[i], "--out-dir=", 10) && argv[i][10])
+			out_dir = argv[i] + 10;
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else {
+			path = jobs_path = nullptr;
 			break;
-		else if (!isdigit(src[i])) {
-			prog_err(line, "non-decimal-digit in number!");
-			return std::nullopt;
 		}
-		data += src[i];
-		++i;
 	}
 	
-	if (i == src.length()) {
-		prog_err(line, "unterminated number!");
-		return std::nullopt;
+	if ((each_line != !!list_path) && path && !jobs_path && !emit && !image_path) {
+#ifdef POSIX_IO
+		return run_each(path, list_path, out_dir, nthreads, jit, flush, cache_dir) ? 0 : 1;
+#else
+		err("--each-line and --each-file are not supported on this platform!");
+		return 1;
+#endif
 	}
 	
-	token tok = {
-		.type = TT_LIT_NUM,
-		.data = data,
-		.line = line,
+	if (jobs_path && !path && !emit && !image_path) {
+#ifdef POSIX_IO
+		return run_many(jobs_path, nthreads, jit, flush, cache_dir) ? 0 : 1;
+#else
+		err("--run-many is not supported on this platform!");
+		return 1;
+#endif
+	}
+	
+	if (!path || jobs_path || each_line || list_path || out_dir || profiling + !!trace_path + !!snap_path > 1 || (snap_every && !snap_path)) {
+		std::cerr << "usage: " << argv[0] << " [--jit] [--emit-cpp] [--batch] [--flush=line|full|none] [--cache=<dir>] [--resume=<snapshot>] [--stats]\n";
+		std::cerr << "       " << std::string(strlen(argv[0]), ' ') << " [--profile[=time] | --trace=<trace> | --snapshot=<snapshot> [--snapshot-every=<n>]] <file>\n";
+		std::cerr << "       " << argv[0] << " --compile <file> -o <image>\n";
+		std::cerr << "       " << argv[0] << " --decode-trace=<trace> <file>\n";
+		std::cerr << "       " << argv[0] << " [--jit] [--flush=line|full|none] [--cache=<dir>] --run-many <jobs> [-j <threads>]\n";
+		std::cerr << "       " << argv[0] << " [--jit] [--flush=line|full|none] [--cache=<dir>] --each-line|--each-file <list> [--out-dir=<dir>] [-j <threads>] <file>\n";
+		return 1;
+	}
+	
+	std::optional<program> prog = load_program(path, cache_dir);
+	if (!prog)
+		return 1;
+	if (image_path) {
+		if (!write_image(*prog, image_path)) {
+			err("failed to write program image!");
+			return 1;
+		}
+		return 0;
+	} else if (emit) {
+		emit_cpp(std::cout, *prog);
+		return 0;
+	} else if (decode_path) {
+		// records are shown with their source lines, unless running an image.
+		std::string buf;
+		std::optional<std::string_view> src = map_file(path, buf);
+		if (!src || is_image(*src))
+			src = std::string_view{};
+		std::ios::sync_with_stdio(false);
+		return decode_trace(decode_path, *prog, *src) ? 0 : 1;
+	}
+	
+	machine machine = new_machine(flush, batch, 0, 1);
+	if (resume_path && !snapshot_read(machine, *prog, resume_path))
+		return 1;
+	
+	profile prof = {};
+	if (profiling) {
+		prof = {
+			.counts = std::vector<uint64_t>(prog->code.size()),
+			.regs = std::vector<uint64_t>(prog->code.size()),
+			.timed = timed,
+			.io_time = {},
+			.total_time = {},
+		};
+		machine.prof = &prof;
+	}
+	
+	trace_ring trace;
+	if (trace_path) {
+		if (!trace_open(trace, trace_path, *prog)) {
+			err("failed to open trace file!");
+			return 1;
+		}
+		machine.trace = &trace;
+	}
+	
+	// snapshots are taken every `snap_every` instructions, and whenever
+	// asked for with `SIGUSR1`.
+	snapshotter snap = {
+		.path = snap_path,
+		.every = snap_every,
+		.left = snap_every ? snap_every : UINT64_MAX,
+		.child = 0,
+		.failed = false,
 	};
+	if (snap_path) {
+#ifdef SIGUSR1
+		std::signal(SIGUSR1, snapshot_signal);
+#endif
+		machine.snap = &snap;
+	}
 	
-	return tok;
+	// standard streams are only used for input from here on.
+	std::ios::sync_with_stdio(false);
+	
+	// the stacks are reserved before counting, so that only growth is.
+	reserve_stacks(machine, *prog);
+	count_allocs.store(stats, std::memory_order_relaxed);
+	run(machine, *prog, jit);
+	count_allocs.store(false, std::memory_order_relaxed);
+	uint64_t allocs = heap_allocs.load(std::memory_order_relaxed);
+	if (trace_path && !trace_close(trace)) {
+		err("failed to write trace file!");
+		return 1;
+	} else if (snap_path && (!snapshot_reap(snap, true) || snap.failed)) {
+		err("failed to write snapshot file!");
+		return 1;
+	}
+	
+	// the profile goes to the standard error, after all program output.
+	std::string buf;
+	std::optional<std::string_view> src;
+	if (profiling && (src = map_file(path, buf))) {
+		if (is_image(*src))
+			src = std::string_view{};
+		std::ostringstream report;
+		print_profile(report, *prog, prof, *src);
+		std::cerr << report.str();
+	}
+	if (stats) {
+		std::ostringstream report;
+		print_stats(report, machine, *prog, allocs);
+		std::cerr << report.str();
+	}
+	
+	return 0;
+}
+
+// replaced only to count allocations, and so only in the executable. every
+// replaceable form is, so that none escape `--stats`. allocating and freeing
+// are never inlined, since gcc would otherwise pair `malloc()` and `free()`
+// with `new` and `delete` and warn.
+__attribute__((noinline)) static void *
+counted_alloc(size_t size, size_t align)
+{
+	if (count_allocs.load(std::memory_order_relaxed))
+		heap_allocs.fetch_add(1, std::memory_order_relaxed);
+	size = size ? size : 1;
+	if (align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+		return malloc(size);
+	return aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+__attribute__((noinline)) static void
+counted_free(void *mem)
+{
+	free(mem);
+}
+
+void *
+operator new(size_t size)
+{
+	if (void *mem = counted_alloc(size, 0))
+		return mem;
+	throw std::bad_alloc{};
+}
+
+void *
+operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *
+operator new(size_t size, std::align_val_t align)
+{
+	if (void *mem = counted_alloc(size, static_cast<size_t>(align)))
+		return mem;
+	throw std::bad_alloc{};
+}
+
+void *
+operator new[](size_t size, std::align_val_t align)
+{
+	return operator new(size, align);
+}
+
+void *
+operator new(size_t size, std::nothrow_t const &) noexcept
+{
+	return counted_alloc(size, 0);
+}
+
+void *
+operator new[](size_t size, std::nothrow_t const &) noexcept
+{
+	return counted_alloc(size, 0);
+}
+
+void *
+operator new(size_t size, std::align_val_t align, std::nothrow_t const &) noexcept
+{
+	return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void *
+operator new[](size_t size, std::align_val_t align, std::nothrow_t const &) noexcept
+{
+	return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void
+operator delete(void *mem) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete(void *mem, size_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem, size_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete(void *mem, std::align_val_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem, std::align_val_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete(void *mem, size_t, std::align_val_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem, size_t, std::align_val_t) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete(void *mem, std::nothrow_t const &) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem, std::nothrow_t const &) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete(void *mem, std::align_val_t, std::nothrow_t const &) noexcept
+{
+	counted_free(mem);
+}
+
+void
+operator delete[](void *mem, std::align_val_t, std::nothrow_t const &) noexcept
+{
+	counted_free(mem);
+}
+#endif
+
+static void
+err(std::string const &msg)
+{
+	std::cerr << "err: " + msg + '\n';
+}
+
+static void
+prog_err(unsigned line, std::string const &msg)
+{
+	// written at once, so that errors from concurrent jobs do not interleave.
+	std::cerr << prog_err_msg(line, msg) + '\n';
+}
+
+static std::string
+prog_err_msg(unsigned line, std::string const &msg)
+{
+	return '[' + std::to_string(line) + "] err: " + msg;
+}
+
+static std::string
+read_file(std::ifstream &f)
+{
+	std::ostringstream ss;
+	ss << f.rdbuf();
+	return ss.str();
+}
+
+static std::optional<std::string_view>
+map_file(char const *path, std::string &buf)
+{
+#ifdef POSIX_IO
+	// regular files are mapped rather than copied.
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		void *mem = MAP_FAILED;
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+			mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mem != MAP_FAILED)
+			return std::string_view{static_cast<char const *>(mem), static_cast<size_t>(st.st_size)};
+	}
+#endif
+	
+	std::ifstream f{path, std::ios::binary};
+	if (!f)
+		return std::nullopt;
+	buf = read_file(f);
+	return buf;
+}
+
+static size_t
+scan_space(std::string_view src, size_t i, unsigned &line)
+{
+#ifdef VEC_X86
+	__m128i const tab = _mm_set1_epi8('\t'), space = _mm_set1_epi8(' ');
+	__m128i const newline = _mm_set1_epi8('\n'), four = _mm_set1_epi8(4);
+	for (; i + 16 <= src.size(); i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src.data() + i));
+		
+		// '\t' through '\r' are contiguous, and so are found with a single
+		// unsigned range check.
+		__m128i ctl = _mm_sub_epi8(v, tab);
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+		unsigned other = ~_mm_movemask_epi8(ws) & 0xffff;
+		unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+		if (other) {
+			unsigned n = __builtin_ctz(other);
+			line += __builtin_popcount(lines & ((1u << n) - 1));
+			return i + n;
+		}
+		line += __builtin_popcount(lines);
+	}
+#endif
+	
+	for (; i < src.size(); ++i) {
+		lex_class cls = lex_table[static_cast<unsigned char>(src[i])].cls;
+		if (cls == LC_NEWLINE)
+			++line;
+		else if (cls != LC_SPACE)
+			break;
+	}
+	return i;
+}
+
+static size_t
+scan_byte(std::string_view src, size_t i, char ch, unsigned &line)
+{
+#ifdef VEC_X86
+	__m128i const target = _mm_set1_epi8(ch), newline = _mm_set1_epi8('\n');
+	for (; i + 16 <= src.size(); i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src.data() + i));
+		unsigned found = _mm_movemask_epi8(_mm_cmpeq_epi8(v, target));
+		unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+		if (found) {
+			unsigned n = __builtin_ctz(found);
+			line += __builtin_popcount(lines & ((1u << n) - 1));
+			return i + n;
+		}
+		line += __builtin_popcount(lines);
+	}
+#endif
+	
+	for (; i < src.size() && src[i] != ch; ++i) {
+		if (src[i] == '\n')
+			++line;
+	}
+	return i;
+}
+
+static size_t
+scan_digits(std::string_view src, size_t i)
+{
+#ifdef VEC_X86
+	__m128i const zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+	for (; i + 16 <= src.size(); i += 16) {
+		__m128i v = _mm_sub_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(src.data() + i)), zero);
+		unsigned digits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, nine), v));
+		if (digits != 0xffff)
+			return i + __builtin_ctz(~digits);
+	}
+#endif
+	
+	while (i < src.size() && src[i] >= '0' && src[i] <= '9')
+		++i;
+	return i;
+}
+
+static std::optional<token>
+lex_string(std::string_view src, size_t &i, unsigned &line, char const *&err)
+{
+	unsigned line_start = line;
+	size_t start = i;
+	
+	i = scan_byte(src, i, '"', line);
+	if (i == src.length()) {
+		line = line_start;
+		err = "unterminated string!";
+		return std::nullopt;
+	}
+	
+	token tok = {
+		.type = TT_LIT_STR,
+		.data = src.substr(start, i - start),
+		.line = line_start,
+	};
+	
+	return tok;
+}
+
+static std::optional<token>
+lex_char(std::string_view src, size_t &i, unsigned &line, char const *&err)
+{
+	if (i == src.length()) {
+		err = "non-existent character!";
+		return std::nullopt;
+	}
+	
+	token tok = {
+		.type = TT_LIT_CH,
+		.data = src.substr(i, 1),
+		.line = line,
+	};
+	
+	if (src[i] == '\n')
+		++line;
+	
+	return tok;
+}
+
+static std::optional<token>
+lex_num(std::string_view src, size_t &i, unsigned &line, char const *&err)
+{
+	size_t start = i;
+	
+	i = scan_digits(src, i);
+	if (i == src.length()) {
+		err = "unterminated number!";
+		return std::nullopt;
+	} else if (src[i] != '$') {
+		err = "non-decimal-digit in number!";
+		return std::nullopt;
+	}
+	
+	token tok = {
+		.type = TT_LIT_NUM,
+		.data = src.substr(start, i - start),
+		.line = line,
+	};
+	
+	return tok;
+}
+
+static std::optional<token>
+lex_token(std::string_view src, size_t &i, unsigned &line, char const *&err)
+{
+	lex_entry ent = lex_table[static_cast<unsigned char>(src[i])];
+	
+	switch (ent.cls) {
+	case LC_SPACE:
+	case LC_NEWLINE:
+	case LC_INVALID:
+		err = "unknown character!";
+		return std::nullopt;
+	case LC_SINGLE:
+		return token{
+			.type = ent.type,
+			.data = {},
+			.line = line,
+		};
+	case LC_STRING:
+		return lex_string(src, ++i, line, err);
+	case LC_CHAR:
+		return lex_char(src, ++i, line, err);
+	case LC_NUM:
+		return lex_num(src, ++i, line, err);
+	default: {
+		// the character after a prefix selects one of its tokens.
+		lex_prefix const &prefix = lex_prefixes[ent.cls - LC_COL];
+		if (++i == src.length()) {
+			err = prefix.missing;
+			return std::nullopt;
+		}
+		
+		void const *suffix = memchr(prefix.suffixes, src[i], strlen(prefix.suffixes));
+		if (!suffix) {
+			err = prefix.invalid;
+			return std::nullopt;
+		}
+		
+		return token{
+			.type = static_cast<token_type>(prefix.first + (static_cast<char const *>(suffix) - prefix.suffixes)),
+			.data = {},
+			.line = line,
+		};
+	}
+	}
+}
+
+static void
+lex_range(std::string_view src, size_t begin, size_t end, unsigned line, lex_chunk &chunk)
+{
+	size_t i = begin;
+	
+	while ((i = scan_space(src, i, line)) < end) {
+		size_t start = i;
+		unsigned line_start = line;
+		std::optional<token> tok = lex_token(src, i, line, chunk.err);
+		if (!tok) {
+			chunk.starts.push_back(start);
+			chunk.end = start;
+			chunk.line = line_start;
+			chunk.err_line = line;
+			return;
+		}
+		
+		chunk.toks.push_back(*tok);
+		chunk.starts.push_back(start);
+		++i;
+	}
+	
+	chunk.end = i;
+	chunk.line = line;
+}
+
+// on failure, `error` is set to the message for the malformed token.
+static std::optional<std::vector<token>>
+lex(std::string_view src, std::string &error)
+{
+	size_t nchunks = std::min<size_t>(std::thread::hardware_concurrency(), src.length() / LEX_CHUNK_MIN);
+	if (nchunks > 1)
+		return lex_parallel(src, nchunks, error);
+	
+	lex_chunk chunk;
+	lex_range(src, 0, src.length(), 1, chunk);
+	if (chunk.err) {
+		error = prog_err_msg(chunk.err_line, chunk.err);
+		return std::nullopt;
+	}
+	
+	return std::move(chunk.toks);
 }
 
 static std::optional<std::vector<token>>
-lex(std::string const &src)
+lex_parallel(std::string_view src, size_t nchunks, std::string &error)
+{
+	std::vector<lex_chunk> chunks(nchunks);
+	std::vector<size_t> bounds(nchunks + 1);
+	for (size_t i = 0; i <= nchunks; ++i)
+		bounds[i] = src.length() * i / nchunks;
+	
+	// lex every chunk as though a token started at its beginning. lines are
+	// counted from there, and so are relative for all but the first chunk.
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < nchunks; ++i) {
+		threads.emplace_back([&, i] {
+			lex_range(src, bounds[i], bounds[i + 1], i ? 0 : 1, chunks[i]);
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+	threads.clear();
+	
+	// walk the chunks in order from where the previous one actually ended,
+	// relexing until reaching a token start the speculative lexing also
+	// found. everything after that point is correct up to the line offset.
+	size_t pos = chunks[0].end;
+	unsigned line = chunks[0].line;
+	std::vector<std::vector<token>> relexed(nchunks);
+	std::vector<size_t> splices(nchunks, 0);
+	std::vector<long> deltas(nchunks, 0);
+	
+	for (size_t i = 0; i < nchunks; ++i) {
+		lex_chunk &chunk = chunks[i];
+		size_t spec = 0;
+		
+		while (i) {
+			while (spec < chunk.starts.size() && chunk.starts[spec] < pos)
+				++spec;
+			
+			if (spec < chunk.starts.size() && chunk.starts[spec] == pos) {
+				long delta = line - (spec < chunk.toks.size() ? chunk.toks[spec].line : chunk.line);
+				splices[i] = spec;
+				deltas[i] = delta;
+				pos = chunk.end;
+				line = chunk.line + delta;
+				chunk.err_line += delta;
+				break;
+			} else if (pos >= bounds[i + 1]) {
+				splices[i] = chunk.toks.size();
+				chunk.err = nullptr;
+				break;
+			}
+			
+			std::optional<token> tok = lex_token(src, pos, line, chunk.err);
+			if (!tok) {
+				chunk.err_line = line;
+				splices[i] = chunk.toks.size();
+				break;
+			}
+			relexed[i].push_back(*tok);
+			pos = scan_space(src, pos + 1, line);
+		}
+		
+		if (chunk.err) {
+			error = prog_err_msg(chunk.err_line, chunk.err);
+			return std::nullopt;
+		}
+	}
+	
+	std::vector<size_t> offsets(nchunks + 1, 0);
+	for (size_t i = 0; i < nchunks; ++i)
+		offsets[i + 1] = offsets[i] + relexed[i].size() + chunks[i].toks.size() - splices[i];
+	
+	std::vector<token> toks(offsets[nchunks]);
+	for (size_t i = 0; i < nchunks; ++i) {
+		threads.emplace_back([&, i] {
+			token *dst = std::copy(relexed[i].begin(), relexed[i].end(), toks.data() + offsets[i]);
+			for (size_t j = splices[i]; j < chunks[i].toks.size(); ++j) {
+				*dst = chunks[i].toks[j];
+				dst++->line += deltas[i];
+			}
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+	
+	return toks;
+}
+
+static program
+compile(std::vector<token> const &toks)
+{
+	program prog;
+	std::unordered_map<std::string_view, int32_t> str_inds;
+	
+	prog.code.reserve(toks.size());
+	prog.lines.reserve(toks.size());
+	
+	for (token const &tok : toks) {
+		instr ins = {
+			.op = static_cast<opcode>(tok.type),
+			.arg = 0,
+		};
+		
+		switch (tok.type) {
+		case TT_LIT_STR: {
+			auto [it, inserted] = str_inds.try_emplace(tok.data, prog.strs.size());
+			if (inserted) {
+				prog.strs.emplace_back(tok.data);
+				prog.str_nums.push_back(atoi(prog.strs.back().c_str()));
+			}
+			ins.arg = it->second;
+			break;
+		}
+		case TT_LIT_CH:
+			ins.arg = tok.data[0];
+			break;
+		case TT_LIT_NUM:
+			ins.arg = atoi(std::string{tok.data}.c_str());
+			break;
+		case TT_TOGGLE_MAT:
+			ins.arg = 0xffff;
+			break;
+		case TT_SAVE_JMP:
+			ins.arg = prog.code.size();
+			break;
+		default:
+			if (tok.type >= TT_TOGGLE_BIT_0 && tok.type <= TT_TOGGLE_BIT_F)
+				ins.arg = 1 << static_cast<int>(tok.type - TT_TOGGLE_BIT_0);
+			else if (tok.type >= TT_TOGGLE_ROW_0 && tok.type <= TT_TOGGLE_ROW_3)
+				ins.arg = 0xf << 4 * static_cast<int>(tok.type - TT_TOGGLE_ROW_0);
+			else if (tok.type >= TT_TOGGLE_COL_0 && tok.type <= TT_TOGGLE_COL_3)
+				ins.arg = 0x1111 << static_cast<int>(tok.type - TT_TOGGLE_COL_0);
+			break;
+		}
+		
+		prog.remap.push_back(prog.code.size());
+		prog.code.push_back(ins);
+		prog.lines.push_back(tok.line);
+	}
+	
+	instr halt = {
+		.op = OP_HALT,
+		.arg = 0,
+	};
+	prog.remap.push_back(prog.code.size());
+	prog.code.push_back(halt);
+	prog.lines.push_back(toks.size() ? toks.back().line : 1);
+	
+	return prog;
+}
+
+// loads either a source file or a compiled image. with `cache_dir`, the image
+// of a source is looked up there by its hash before lexing it, and stored
+// there after.
+static std::optional<program>
+load_program(char const *path, char const *cache_dir)
+{
+	std::string buf;
+	std::optional<std::string_view> src = map_file(path, buf);
+	if (!src) {
+		err("failed to open file!");
+		return std::nullopt;
+	}
+	
+	std::string error;
+	std::optional<program> prog;
+	if (is_image(*src)) {
+		if (!(prog = read_image(*src, error)))
+			err(error);
+	} else {
+		uint64_t src_hash = hash_bytes(image_version(), src->data(), src->length());
+		std::string cache_path;
+		if (cache_dir) {
+			char name[24];
+			snprintf(name, sizeof(name), "%016llx.ematc", static_cast<unsigned long long>(src_hash));
+			cache_path = std::string{cache_dir} + '/' + name;
+			
+			// anything wrong with a cached image just means compiling
+			// again.
+			std::string image_buf, image_error;
+			std::optional<std::string_view> image = map_file(cache_path.c_str(), image_buf);
+			if (image) {
+				prog = read_image(*image, image_error);
+				if (prog && prog->src_hash != src_hash)
+					prog = std::nullopt;
+#ifdef POSIX_IO
+				if (image->data() != image_buf.data())
+					munmap(const_cast<char *>(image->data()), image->size());
+#endif
+			}
+		}
+		
+		std::optional<std::vector<token>> toks;
+		if (!prog && !(toks = lex(*src, error))) {
+			std::cerr << error + '\n';
+			err("failed to lex file!");
+		} else if (!prog) {
+			prog = compile(*toks);
+			optimize(*prog);
+			resolve_loops(*prog);
+			specialize_types(*prog);
+			specialize_sels(*prog);
+			size_stacks(*prog);
+			prog->src_hash = src_hash;
+			if (cache_dir && !write_image(*prog, cache_path.c_str()))
+				err("failed to write " + cache_path + "!");
+		}
+	}
+	
+#ifdef POSIX_IO
+	// the program holds no references into its source.
+	if (src->data() != buf.data())
+		munmap(const_cast<char *>(src->data()), src->size());
+#endif
+	
+	return prog;
+}
+
+// FNV-1a, continuing from `hash`.
+static uint64_t
+hash_bytes(uint64_t hash, void const *data, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= static_cast<unsigned char const *>(data)[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+// changes whenever the image format or the instruction set does, so that
+// images written by other builds are never misread.
+static uint64_t
+image_version(void)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	size_t sizes[] = {IMAGE_FORMAT, sizeof(instr), sizeof(long), OP_HALT};
+	hash = hash_bytes(hash, sizes, sizeof(sizes));
+	for (char const *name : op_names)
+		hash = hash_bytes(hash, name, strlen(name) + 1);
+	return hash;
+}
+
+static bool
+is_image(std::string_view data)
+{
+	return data.starts_with(std::string_view{"EMATC\0\0\0", 8});
+}
+
+// the size of `len` elements of `size` bytes, or `SIZE_MAX` if that does not
+// fit, so that lengths read from files are never wrapped around into range.
+static size_t
+array_size(uint64_t len, size_t size)
+{
+	return len > SIZE_MAX / size ? SIZE_MAX : len * size;
+}
+
+// the arrays of the image are copied out whole, with no parsing.
+static std::optional<program>
+read_image(std::string_view data, std::string &error)
+{
+	image_header header;
+	if (data.length() < sizeof(header) || !is_image(data)) {
+		error = "invalid program image!";
+		return std::nullopt;
+	}
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.version != image_version()) {
+		error = "program image was compiled by another version of ematrm!";
+		return std::nullopt;
+	}
+	
+	size_t sizes[] = {
+		array_size(header.code_len, sizeof(instr)),
+		array_size(header.code_len, sizeof(long)),
+		array_size(header.strs_len, sizeof(long)),
+		array_size(header.remap_len, sizeof(int32_t)),
+		array_size(header.sels_len, sizeof(image_sel)),
+		array_size(header.strs_len, sizeof(uint32_t)),
+		array_size(header.chars_len, 1),
+	};
+	size_t total = sizeof(header);
+	for (size_t size : sizes) {
+		if (size > data.length() - total) {
+			total = SIZE_MAX;
+			break;
+		}
+		total += size;
+	}
+	if (data.length() != total || !header.code_len || !header.remap_len) {
+		error = "invalid program image!";
+		return std::nullopt;
+	}
+	
+	program prog;
+	char const *pos = data.data() + sizeof(header);
+	auto take = [&]<typename T>(std::vector<T> &vec, size_t len) {
+		vec.resize(len);
+		memcpy(vec.data(), pos, len * sizeof(T));
+		pos += len * sizeof(T);
+	};
+	take(prog.code, header.code_len);
+	take(prog.lines, header.code_len);
+	take(prog.str_nums, header.strs_len);
+	take(prog.remap, header.remap_len);
+	std::vector<image_sel> sels;
+	take(sels, header.sels_len);
+	std::vector<uint32_t> str_lens;
+	take(str_lens, header.strs_len);
+	
+	prog.strs.reserve(header.strs_len);
+	char const *end = pos + header.chars_len;
+	for (uint32_t len : str_lens) {
+		if (len > static_cast<size_t>(end - pos))
+			break;
+		prog.strs.emplace_back(pos, len);
+		pos += len;
+	}
+	
+	// every operand indexing something is checked, since nothing else
+	// bounds them at run time. branches may only go to loop heads.
+	bool valid = pos == end && prog.code.back().op == OP_HALT;
+	size_t len = prog.code.size() - 1;
+	for (size_t i = 0; i < prog.code.size(); ++i) {
+		instr const &ins = prog.code[i];
+		uint32_t arg = ins.arg;
+		switch (ins.op) {
+		case OP_LIT_STR:
+			valid &= arg < prog.strs.size();
+			break;
+		case OP_SET_SEL:
+			valid &= arg < sels.size();
+			break;
+		case OP_BRANCH:
+		case OP_BRANCH_COND:
+			valid &= arg < len && prog.code[arg].op == OP_LOOP_HEAD;
+			break;
+		case OP_HALT:
+			valid &= i == len;
+			break;
+		default:
+			valid &= ins.op < OP_HALT;
+			break;
+		}
+	}
+	for (int32_t target : prog.remap)
+		valid &= target >= 0 && static_cast<size_t>(target) < prog.code.size();
+	for (long line : prog.lines)
+		valid &= line >= 1 && line <= UINT_MAX;
+	valid &= header.atoms_reserve <= STACK_RESERVE_MAX && header.jumps_reserve <= STACK_RESERVE_MAX;
+	valid &= header.arena_reserve <= STACK_RESERVE_MAX * (REG_STR_SIZE + 1);
+	
+	// the registers selected are listed anew rather than trusted.
+	prog.sels.resize(sels.size());
+	for (size_t i = 0; i < sels.size(); ++i) {
+		valid &= sels[i].mode <= OM_COL && sels[i].rev <= 1;
+		if (!valid)
+			break;
+		
+		reg_sel &sel = prog.sels[i];
+		sel.mask = sels[i].mask;
+		sel.mode = static_cast<op_mode>(sels[i].mode);
+		sel.rev = sels[i].rev;
+		sel.order_len = order_regs(sel.mask, sel.mode, sel.rev, sel.order, sel.positions);
+	}
+	if (!valid) {
+		error = "invalid program image!";
+		return std::nullopt;
+	}
+	
+	prog.src_hash = header.src_hash;
+	prog.atoms_reserve = header.atoms_reserve;
+	prog.jumps_reserve = header.jumps_reserve;
+	prog.arena_reserve = header.arena_reserve;
+	return prog;
+}
+
+// like snapshots, the image is moved into place only once complete, so that
+// concurrent runs sharing a cache never see part of one.
+static bool
+write_image(program const &prog, char const *path)
+{
+	std::vector<uint32_t> str_lens;
+	size_t chars_len = 0;
+	for (std::string const &str : prog.strs) {
+		str_lens.push_back(str.length());
+		chars_len += str.length();
+	}
+	std::vector<image_sel> sels;
+	for (reg_sel const &sel : prog.sels) {
+		sels.push_back(image_sel{
+			.mask = sel.mask,
+			.mode = static_cast<uint8_t>(sel.mode),
+			.rev = sel.rev,
+		});
+	}
+	
+	image_header header = {
+		.magic = {'E', 'M', 'A', 'T', 'C', 0, 0, 0},
+		.version = image_version(),
+		.src_hash = prog.src_hash,
+		.code_len = prog.code.size(),
+		.strs_len = prog.strs.size(),
+		.remap_len = prog.remap.size(),
+		.chars_len = chars_len,
+		.sels_len = prog.sels.size(),
+		.atoms_reserve = prog.atoms_reserve,
+		.jumps_reserve = prog.jumps_reserve,
+		.arena_reserve = prog.arena_reserve,
+	};
+	
+	std::string tmp_path = std::string{path} + ".tmp" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file)
+		return false;
+	
+	auto put = [&]<typename T>(std::vector<T> const &vec) {
+		return fwrite(vec.data(), sizeof(T), vec.size(), file) == vec.size();
+	};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && put(prog.code) && put(prog.lines) && put(prog.str_nums) && put(prog.remap) && put(sels) && put(str_lens);
+	for (std::string const &str : prog.strs)
+		ok = ok && fwrite(str.data(), 1, str.length(), file) == str.length();
+	ok = !fclose(file) && ok;
+	
+	if (ok && !std::rename(tmp_path.c_str(), path))
+		return true;
+	std::remove(tmp_path.c_str());
+	return false;
+}
+
+static void
+optimize(program &prog)
+{
+	size_t len = prog.code.size() - 1;
+	
+	// `j<` can jump into the middle of anything merged together.
+	for (instr const &ins : prog.code) {
+		if (ins.op == OP_PUSH_JMP)
+			return;
+	}
+	
+	std::vector<instr> code;
+	std::vector<long> lines;
+	code.reserve(prog.code.size());
+	lines.reserve(prog.code.size());
+	
+	for (size_t i = 0; i < len;) {
+		size_t start = i;
+		int32_t first = code.size();
+		auto add = [&](opcode op, int32_t arg) {
+			code.push_back(instr{.op = op, .arg = arg});
+			lines.push_back(prog.lines[start]);
+		};
+		
+		// mask, mode and order changes don't affect each other, so a run of
+		// them is reduced to at most one of each. the only way to jump into
+		// such a run is through a `.`, which isn't part of it.
+		uint16_t mask = 0;
+		std::optional<opcode> mode;
+		bool rev = false;
+		for (; i < len; ++i) {
+			opcode op = prog.code[i].op;
+			if (op >= OP_TOGGLE_BIT_0 && op <= OP_TOGGLE_MAT)
+				mask ^= prog.code[i].arg;
+			else if (op == OP_MODE_COL || op == OP_MODE_ROW)
+				mode = op;
+			else if (op == OP_ORDER_REV)
+				rev = !rev;
+			else
+				break;
+		}
+		
+		if (i > start) {
+			if (mask)
+				add(OP_XOR_MASK, mask);
+			if (mode)
+				add(*mode, 0);
+			if (rev)
+				add(OP_ORDER_REV, 0);
+		} else {
+			// a numeric literal popped straight away becomes an immediate
+			// operand.
+			instr ins = prog.code[i++];
+			auto imm = std::find_if(std::begin(imm_ops), std::end(imm_ops), [&](auto const &ops) {
+				return ops.first == prog.code[i].op;
+			});
+			if (ins.op == OP_LIT_NUM && imm != std::end(imm_ops)) {
+				ins.op = imm->second;
+				++i;
+			}
+			add(ins.op, ins.arg);
+		}
+		
+		for (size_t j = start; j < i; ++j)
+			prog.remap[j] = first;
+	}
+	
+	prog.remap[len] = code.size();
+	code.push_back(prog.code[len]);
+	lines.push_back(prog.lines[len]);
+	
+	prog.code = std::move(code);
+	prog.lines = std::move(lines);
+}
+
+// lists the registers `mask` selects in visiting order, returning how many,
+// and records the position of each in `positions`.
+static uint8_t
+order_regs(uint16_t mask, op_mode mode, bool rev, uint8_t *order, long *positions)
+{
+	uint8_t const *all = reg_orders[mode][rev];
+	uint8_t len = 0;
+	for (int i = 0; i < 16; ++i) {
+		if (mask & 1 << all[i]) {
+			positions[all[i]] = len;
+			order[len++] = all[i];
+		}
+	}
+	return len;
+}
+
+static void
+update_order(machine &machine)
 {
-	std::vector<token> toks;
-	unsigned line = 1;
+	machine.order_len = order_regs(machine.mask, machine.mode, machine.rev, machine.order, machine.positions);
+	machine.order_dirty = false;
+}
+
+template<typename F>
+static void
+for_each_reg(machine &machine, F const &fn)
+{
+	if (machine.order_dirty)
+		update_order(machine);
 	
-	for (size_t i = 0; i < src.length(); ++i) {
-		// skip whitespace.
-		if (src[i] == '\n') {
-			++line;
+	for (uint8_t i = 0; i < machine.order_len; ++i)
+		fn(machine.order[i]);
+}
+
+static char const *
+atom_str(machine const &machine, program const &prog, atom const &atom)
+{
+	if (atom.type == AT_STR)
+		return prog.strs[atom.ref].c_str();
+	return &machine.str_arena[atom.ref];
+}
+
+static void
+pop_atom(machine &machine)
+{
+	if (machine.atoms.back().type == AT_REG_STR)
+		machine.str_arena.resize(machine.atoms.back().ref);
+	machine.atoms.pop_back();
+}
+
+static long const *
+order_positions(machine &machine)
+{
+	if (machine.order_dirty)
+		update_order(machine);
+	return machine.positions;
+}
+
+// copies `str` into a register-sized buffer like `strncpy()` would, returning
+// its length, which is more than `REG_STR_SIZE` if it does not fit.
+static size_t
+pad_str(char const *str, char *padded)
+{
+	size_t len = strnlen(str, REG_STR_SIZE + 1);
+	size_t n = std::min<size_t>(len, REG_STR_SIZE);
+	memcpy(padded, str, n);
+	memset(padded + n, 0, REG_STR_SIZE - n);
+	return len;
+}
+
+// the registers holding the `len` bytes long string padded into `padded`, as
+// a mask, including ones which hold integers. all lengths are compared at
+// once, and only strings of the right length compared further.
+static uint16_t
+match_strs(reg_file const &regs, char const *padded, size_t len)
+{
+	uint16_t same = 0;
+	
+#ifdef VEC_X86
+	// a string is covered by two vectors and a third overlapping the second.
+	static_assert(REG_STR_SIZE > 32 && REG_STR_SIZE <= 48);
+	auto load = [](char const *p) {
+		return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+	};
+	
+	__m128i lens = _mm_loadu_si128(reinterpret_cast<__m128i const *>(regs.lens));
+	unsigned cands = _mm_movemask_epi8(_mm_cmpeq_epi8(lens, _mm_set1_epi8(len)));
+	__m128i lo = load(padded), mid = load(padded + 16), hi = load(padded + REG_STR_SIZE - 16);
+	for (; cands; cands &= cands - 1) {
+		unsigned num = __builtin_ctz(cands);
+		char const *str = regs.strs[num];
+		__m128i eq = _mm_and_si128(_mm_cmpeq_epi8(load(str), lo), _mm_cmpeq_epi8(load(str + 16), mid));
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi8(load(str + REG_STR_SIZE - 16), hi));
+		if (_mm_movemask_epi8(eq) == 0xffff)
+			same |= 1 << num;
+	}
+#else
+	for (size_t num = 0; num < 16; ++num) {
+		if (regs.lens[num] == len && !memcmp(regs.strs[num], padded, REG_STR_SIZE))
+			same |= 1 << num;
+	}
+#endif
+	
+	return same;
+}
+
+// parses like `atoi()`, down to truncating what `strtol()` would return to an
+// `int`, but without needing the string to be null-terminated.
+static long
+parse_int(char const *str, size_t len)
+{
+	char const *p = str, *end = str + len;
+	while (p < end && isspace(static_cast<unsigned char>(*p)))
+		++p;
+	bool neg = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		++p;
+	
+	// out of range values are clamped like `strtol()` clamps them.
+	unsigned long mag;
+	unsigned long limit = neg ? 1ul + LONG_MAX : LONG_MAX;
+	auto [ptr, ec] = std::from_chars(p, end, mag);
+	if (ec == std::errc::invalid_argument)
+		return 0;
+	else if (ec == std::errc::result_out_of_range || mag > limit)
+		mag = limit;
+	
+	return static_cast<int>(neg ? -mag : mag);
+}
+
+static void
+sink_flush(out_sink &out)
+{
+	if (out.write) {
+		if (out.len)
+			out.write(out.write_ctx, out.buf.data(), out.len);
+		out.len = 0;
+		return;
+	} else if (out.fd < 0)
+		return;
+	
+#ifdef POSIX_IO
+	size_t done = 0;
+	while (done < out.len) {
+		ssize_t n = write(out.fd, out.buf.data() + done, out.len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			break;
+		done += n;
+	}
+#else
+	fwrite(out.buf.data(), 1, out.len, stdout);
+	fflush(stdout);
+#endif
+	out.len = 0;
+}
+
+static void
+sink_write(out_sink &out, char const *data, size_t len)
+{
+	if (out.fd < 0 && !out.write && out.len + len > out.buf.size())
+		out.buf.resize(std::max(2 * out.buf.size(), out.len + len));
+	else if (out.len + len > out.buf.size()) {
+		// data longer than the whole buffer is passed on in pieces.
+		for (; len > out.buf.size(); data += out.buf.size(), len -= out.buf.size())
+			sink_write(out, data, out.buf.size());
+		if (out.len + len > out.buf.size())
+			sink_flush(out);
+	}
+	memcpy(out.buf.data() + out.len, data, len);
+	out.len += len;
+	
+	if (out.mode == FM_NONE || (out.mode == FM_LINE && memchr(data, '\n', len)))
+		sink_flush(out);
+}
+
+static void
+sink_num(out_sink &out, long num)
+{
+	char buf[24];
+	char *end = std::to_chars(buf, buf + sizeof(buf), num).ptr;
+	sink_write(out, buf, end - buf);
+}
+
+static void
+source_open(in_source &in, int fd)
+{
+	in.fd = fd;
+	
+#ifdef POSIX_IO
+	// a regular file is mapped in whole, starting from wherever the
+	// descriptor is positioned.
+	struct stat st;
+	off_t off = lseek(fd, 0, SEEK_CUR);
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && off >= 0 && off < st.st_size) {
+		void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mem != MAP_FAILED) {
+			in.mapped = true;
+			in.data = static_cast<char const *>(mem);
+			in.pos = off;
+			in.len = st.st_size;
+			return;
+		}
+	}
+#endif
+	
+	in.buf.resize(IN_BUF_SIZE);
+	in.data = in.buf.data();
+}
+
+static bool
+source_fill(in_source &in)
+{
+	if (in.mapped || (in.fd < 0 && !in.read))
+		return false;
+	
+	in.pos = 0;
+	if (in.read) {
+		in.len = in.read(in.read_ctx, in.buf.data(), in.buf.size());
+		return in.len;
+	}
+	
+#ifdef POSIX_IO
+	ssize_t n;
+	do
+		n = read(in.fd, in.buf.data(), in.buf.size());
+	while (n < 0 && errno == EINTR);
+#else
+	size_t n = fread(in.buf.data(), 1, in.buf.size(), stdin);
+#endif
+	
+	in.len = n > 0 ? n : 0;
+	return in.len;
+}
+
+// reads the next whitespace-delimited word like `std::cin >> str` would, into
+// a register-sized buffer, padding it with zeroes like `strncpy()` would.
+static void
+source_word(in_source &in, char *word)
+{
+	size_t len = 0;
+	bool started = false;
+	
+	memset(word, 0, REG_STR_SIZE);
+	for (;;) {
+		if (in.pos == in.len && !source_fill(in))
+			return;
+		
+		char const *p = in.data + in.pos, *end = in.data + in.len;
+		if (!started) {
+			while (p < end && isspace(static_cast<unsigned char>(*p)))
+				++p;
+			started = p < end;
+		}
+		
+		char const *start = p;
+		while (p < end && !isspace(static_cast<unsigned char>(*p)))
+			++p;
+		
+		size_t n = std::min<size_t>(p - start, REG_STR_SIZE - len);
+		memcpy(word + len, start, n);
+		len += n;
+		in.pos = p - in.data;
+		
+		if (p < end && started)
+			return;
+	}
+}
+
+static void
+source_view(in_source &in, std::string_view data)
+{
+	in.fd = -1;
+	in.data = data.data();
+	in.pos = 0;
+	in.len = data.length();
+}
+
+static void
+source_close(in_source &in)
+{
+#ifdef POSIX_IO
+	if (in.mapped)
+		munmap(const_cast<char *>(in.data), in.len);
+#endif
+	in.mapped = false;
+	in.read = nullptr;
+	in.data = nullptr;
+	in.pos = in.len = 0;
+}
+
+static void
+vec_apply_scalar(vec_op op, long *nums, uint16_t mask, long const *opnds)
+{
+	for (int i = 0; i < 16; ++i) {
+		if (!(mask & 1 << i))
 			continue;
-		} else if (isspace(src[i]))
+		
+		// arithmetic wraps around rather than overflowing.
+		unsigned long a = nums[i], b = opnds[i];
+		switch (op) {
+		case VO_ADD:
+			nums[i] = a + b;
+			break;
+		case VO_SUB:
+			nums[i] = a - b;
+			break;
+		case VO_MUL:
+			nums[i] = a * b;
+			break;
+		case VO_EQUAL:
+			nums[i] = nums[i] == opnds[i];
+			break;
+		case VO_GREQUAL:
+			nums[i] = nums[i] >= opnds[i];
+			break;
+		case VO_GREATER:
+			nums[i] = nums[i] > opnds[i];
+			break;
+		case VO_LESS:
+			nums[i] = nums[i] < opnds[i];
+			break;
+		case VO_LEQUAL:
+			nums[i] = nums[i] <= opnds[i];
+			break;
+		}
+	}
+}
+
+#ifdef VEC_X86
+__attribute__((target("avx2")))
+static void
+vec_apply_avx2(vec_op op, long *nums, uint16_t mask, long const *opnds)
+{
+	__m256i const bits = _mm256_setr_epi64x(1, 2, 4, 8);
+	__m256i const one = _mm256_set1_epi64x(1);
+	
+	// the register file is processed as four rows of four registers, with
+	// each 4-bit slice of the mask expanded into lane masks for blending.
+	for (int i = 0; i < 16; i += 4) {
+		__m256i sel = _mm256_set1_epi64x(mask >> i & 0xf);
+		sel = _mm256_cmpeq_epi64(_mm256_and_si256(sel, bits), bits);
+		
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(nums + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(opnds + i));
+		__m256i res = a;
+		switch (op) {
+		case VO_ADD:
+			res = _mm256_add_epi64(a, b);
+			break;
+		case VO_SUB:
+			res = _mm256_sub_epi64(a, b);
+			break;
+		case VO_MUL: {
+			// there is no 64-bit multiply in avx2, so it is assembled out
+			// of 32-bit partial products.
+			__m256i lo = _mm256_mul_epu32(a, b);
+			__m256i mid = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+			                               _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+			res = _mm256_add_epi64(lo, _mm256_slli_epi64(mid, 32));
+			break;
+		}
+		case VO_EQUAL:
+			res = _mm256_and_si256(_mm256_cmpeq_epi64(a, b), one);
+			break;
+		case VO_GREQUAL:
+			res = _mm256_add_epi64(_mm256_cmpgt_epi64(b, a), one);
+			break;
+		case VO_GREATER:
+			res = _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one);
+			break;
+		case VO_LESS:
+			res = _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one);
+			break;
+		case VO_LEQUAL:
+			res = _mm256_add_epi64(_mm256_cmpgt_epi64(a, b), one);
+			break;
+		}
+		
+		res = _mm256_blendv_epi8(a, res, sel);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(nums + i), res);
+	}
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void
+vec_apply_avx512(vec_op op, long *nums, uint16_t mask, long const *opnds)
+{
+	__m512i const one = _mm512_set1_epi64(1);
+	
+	// the register file is processed as two halves of eight registers, with
+	// the mask used directly for a masked store.
+	for (int i = 0; i < 16; i += 8) {
+		__m512i a = _mm512_loadu_si512(nums + i);
+		__m512i b = _mm512_loadu_si512(opnds + i);
+		__m512i res = a;
+		switch (op) {
+		case VO_ADD:
+			res = _mm512_add_epi64(a, b);
+			break;
+		case VO_SUB:
+			res = _mm512_sub_epi64(a, b);
+			break;
+		case VO_MUL:
+			res = _mm512_mullo_epi64(a, b);
+			break;
+		case VO_EQUAL:
+			res = _mm512_maskz_mov_epi64(_mm512_cmpeq_epi64_mask(a, b), one);
+			break;
+		case VO_GREQUAL:
+			res = _mm512_maskz_mov_epi64(_mm512_cmpge_epi64_mask(a, b), one);
+			break;
+		case VO_GREATER:
+			res = _mm512_maskz_mov_epi64(_mm512_cmpgt_epi64_mask(a, b), one);
+			break;
+		case VO_LESS:
+			res = _mm512_maskz_mov_epi64(_mm512_cmplt_epi64_mask(a, b), one);
+			break;
+		case VO_LEQUAL:
+			res = _mm512_maskz_mov_epi64(_mm512_cmple_epi64_mask(a, b), one);
+			break;
+		}
+		
+		_mm512_mask_storeu_epi64(nums + i, mask >> i & 0xff, res);
+	}
+}
+#endif
+
+static vec_fn
+vec_select(void)
+{
+#ifdef VEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+		return vec_apply_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return vec_apply_avx2;
+#endif
+	return vec_apply_scalar;
+}
+
+static void
+vec_apply(machine &machine, vec_op op, long const *opnds)
+{
+	static vec_fn const impl = vec_select();
+	impl(op, machine.regs.nums, machine.mask & machine.regs.ints, opnds);
+}
+
+static void
+vec_apply_val(machine &machine, vec_op op, long val)
+{
+	long opnds[16];
+	std::fill_n(opnds, 16, val);
+	vec_apply(machine, op, opnds);
+}
+
+static void
+prof_count(machine &machine, program const &prog)
+{
+	++machine.prof->counts[machine.instr_ptr];
+	machine.prof->regs[machine.instr_ptr] += std::popcount(machine.mask);
+	
+	// a taken branch skips the loop head, which would have run again had
+	// the loop not been resolved, so it is counted here instead.
+	instr const &ins = prog.code[machine.instr_ptr];
+	bool taken = ins.op == OP_BRANCH;
+	if (ins.op == OP_BRANCH_COND)
+		taken = machine.atoms.size() && machine.atoms.back().num;
+	if (taken) {
+		++machine.prof->counts[ins.arg];
+		machine.prof->regs[ins.arg] += std::popcount(machine.mask);
+	}
+}
+
+static std::chrono::steady_clock::time_point
+prof_now(machine const &machine)
+{
+	return machine.prof->timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+}
+
+static void
+prof_io(machine &machine, std::chrono::steady_clock::time_point start)
+{
+	if (machine.prof->timed)
+		machine.prof->io_time += std::chrono::steady_clock::now() - start;
+}
+
+static bool
+trace_open(trace_ring &ring, char const *path, program const &prog)
+{
+	ring.file = fopen(path, "wb");
+	if (!ring.file)
+		return false;
+	
+	trace_header header = {
+		.magic = {'E', 'M', 'T', 'R', 'A', 'C', 'E', '1'},
+		.prog_hash = program_hash(prog),
+	};
+	if (fwrite(&header, sizeof(header), 1, ring.file) != 1) {
+		fclose(ring.file);
+		return false;
+	}
+	
+	ring.recs.resize(TRACE_RING_SIZE);
+	ring.head = ring.tail = 0;
+	ring.done = false;
+	ring.local_head = ring.limit = 0;
+	ring.failed = false;
+	ring.writer = std::thread{trace_drain, std::ref(ring)};
+	return true;
+}
+
+static void
+trace_step(machine &machine, program const &prog)
+{
+	trace_ring &ring = *machine.trace;
+	if (ring.local_head == ring.limit)
+		trace_reserve(ring);
+	
+	ring.recs[ring.local_head++ & (TRACE_RING_SIZE - 1)] = trace_rec{
+		.instr_ptr = static_cast<uint32_t>(machine.instr_ptr),
+		.op = prog.code[machine.instr_ptr].op,
+		.pad = 0,
+		.mask = machine.mask,
+		.atoms = static_cast<uint32_t>(machine.atoms.size()),
+		.jumps = static_cast<uint32_t>(machine.jumps.size()),
+	};
+}
+
+// publishes the records written so far, and waits for room for another
+// `TRACE_CHUNK` of them.
+static void
+trace_reserve(trace_ring &ring)
+{
+	ring.head.store(ring.local_head, std::memory_order_release);
+	while (ring.local_head + TRACE_CHUNK - ring.tail.load(std::memory_order_acquire) > TRACE_RING_SIZE)
+		std::this_thread::yield();
+	ring.limit = ring.local_head + TRACE_CHUNK;
+}
+
+// run by the writer thread until the interpreter is done.
+static void
+trace_drain(trace_ring &ring)
+{
+	uint64_t tail = 0;
+	for (;;) {
+		bool done = ring.done.load(std::memory_order_acquire);
+		uint64_t head = ring.head.load(std::memory_order_acquire);
+		if (head == tail) {
+			if (done)
+				return;
+			std::this_thread::sleep_for(std::chrono::microseconds{100});
 			continue;
+		}
+		
+		// written up to where the buffer wraps around, at most.
+		size_t start = tail & (TRACE_RING_SIZE - 1);
+		size_t count = std::min<uint64_t>(head - tail, TRACE_RING_SIZE - start);
+		if (!ring.failed && fwrite(&ring.recs[start], sizeof(trace_rec), count, ring.file) != count)
+			ring.failed = true;
+		
+		tail += count;
+		ring.tail.store(tail, std::memory_order_release);
+	}
+}
+
+static bool
+trace_close(trace_ring &ring)
+{
+	ring.head.store(ring.local_head, std::memory_order_release);
+	ring.done.store(true, std::memory_order_release);
+	ring.writer.join();
+	return !fclose(ring.file) && !ring.failed;
+}
+
+static bool
+decode_trace(char const *path, program const &prog, std::string_view src)
+{
+	std::string buf;
+	std::optional<std::string_view> data = map_file(path, buf);
+	trace_header header;
+	if (!data || data->length() < sizeof(header) || memcmp(data->data(), "EMTRACE1", 8)) {
+		err("failed to read trace file!");
+		return false;
+	}
+	
+	memcpy(&header, data->data(), sizeof(header));
+	if (header.prog_hash != program_hash(prog)) {
+		err("trace was recorded from a different program!");
+		return false;
+	}
+	
+	// the text of each line, without its indentation.
+	std::vector<std::string_view> src_lines;
+	for (size_t pos = 0; pos < src.length();) {
+		size_t end = std::min(src.find('\n', pos), src.length());
+		size_t start = std::min(src.find_first_not_of(" \t", pos), end);
+		src_lines.push_back(src.substr(start, end - start));
+		pos = end + 1;
+	}
+	
+	size_t len = prog.code.size();
+	size_t count = (data->length() - sizeof(header)) / sizeof(trace_rec);
+	char line[128];
+	for (size_t i = 0; i < count; ++i) {
+		trace_rec rec;
+		memcpy(&rec, data->data() + sizeof(header) + i * sizeof(trace_rec), sizeof(rec));
+		if (rec.instr_ptr >= len || rec.op != prog.code[rec.instr_ptr].op) {
+			err("invalid instruction in trace file!");
+			return false;
+		}
+		
+		long src_line = prog.lines[rec.instr_ptr];
+		snprintf(line, sizeof(line), "%zu [%ld] %u %s mask=%04x atoms=%u jumps=%u",
+		         i, src_line, rec.instr_ptr, op_names[rec.op], rec.mask, rec.atoms, rec.jumps);
+		std::cout << line;
+		if (static_cast<size_t>(src_line) <= src_lines.size())
+			std::cout << "  " << src_lines[src_line - 1];
+		std::cout << '\n';
+	}
+	
+	return true;
+}
+
+static volatile std::sig_atomic_t snapshot_requested;
+
+static void
+snapshot_signal(int sig)
+{
+	(void)sig;
+	snapshot_requested = 1;
+}
+
+static void
+snapshot_step(machine &machine, program const &prog)
+{
+	if (--machine.snap->left && !snapshot_requested)
+		return;
+	snapshot_take(machine, prog);
+}
+
+// writes the snapshot from a child process where possible, so that the
+// interpreter only waits for the fork. output so far is flushed first, so that
+// it is not repeated on resuming.
+static void
+snapshot_take(machine &machine, program const &prog)
+{
+	snapshotter &snap = *machine.snap;
+	snapshot_requested = 0;
+	snap.left = snap.every ? snap.every : UINT64_MAX;
+	sink_flush(machine.out);
+	
+	// only one snapshot is written at a time.
+	if (!snapshot_reap(snap, true))
+		snap.failed = true;
+	
+#ifdef POSIX_IO
+	pid_t pid = fork();
+	if (pid == 0)
+		_exit(snapshot_write(machine, prog, snap.path) ? 0 : 1);
+	else if (pid > 0) {
+		snap.child = pid;
+		return;
+	}
+#endif
+	
+	if (!snapshot_write(machine, prog, snap.path))
+		snap.failed = true;
+}
+
+// collects the process writing the last snapshot, if it has finished or
+// `wait` is set. returns whether it succeeded.
+static bool
+snapshot_reap(snapshotter &snap, bool wait)
+{
+#ifdef POSIX_IO
+	int status;
+	if (!snap.child || waitpid(snap.child, &status, wait ? 0 : WNOHANG) == 0)
+		return true;
+	snap.child = 0;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+	(void)snap;
+	(void)wait;
+	return true;
+#endif
+}
+
+// the snapshot is written next to `path` and then moved over it, so that a
+// crash while writing leaves the previous one intact.
+static bool
+snapshot_write(machine const &machine, program const &prog, char const *path)
+{
+	std::vector<atom> const &atoms = machine.atoms;
+	std::vector<long> const &jumps = machine.jumps;
+	snapshot_header header = {
+		.magic = {'E', 'M', 'S', 'N', 'A', 'P', '0', '2'},
+		.prog_hash = program_hash(prog),
+		.instr_ptr = machine.instr_ptr,
+		.mask = machine.mask,
+		.mode = static_cast<uint8_t>(machine.mode),
+		.rev = machine.rev,
+		.pad = 0,
+		.atoms = atoms.size(),
+		.jumps = jumps.size(),
+		.arena_len = machine.str_arena.size(),
+	};
+	
+	std::string tmp_path = std::string{path} + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file)
+		return false;
+	
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(&machine.regs, sizeof(machine.regs), 1, file) == 1;
+	ok = ok && fwrite(atoms.data(), sizeof(atom), atoms.size(), file) == atoms.size();
+	ok = ok && fwrite(jumps.data(), sizeof(long), jumps.size(), file) == jumps.size();
+	ok = ok && fwrite(machine.str_arena.data(), 1, machine.str_arena.size(), file) == machine.str_arena.size();
+	ok = !fclose(file) && ok;
+	
+	return ok && !std::rename(tmp_path.c_str(), path);
+}
+
+static bool
+snapshot_read(machine &machine, program const &prog, char const *path)
+{
+	std::string buf;
+	std::optional<std::string_view> src = map_file(path, buf);
+	snapshot_header header;
+	if (!src || src->length() < sizeof(header) || memcmp(src->data(), "EMSNAP02", 8)) {
+		err("failed to read snapshot file!");
+		return false;
+	}
+	
+	memcpy(&header, src->data(), sizeof(header));
+	if (header.prog_hash != program_hash(prog)) {
+		err("snapshot was taken of a different program!");
+		return false;
+	}
+	
+	size_t atoms_len = array_size(header.atoms, sizeof(atom)), jumps_len = array_size(header.jumps, sizeof(long));
+	size_t left = src->length() - sizeof(header);
+	bool valid = left >= sizeof(reg_file);
+	left -= valid ? sizeof(reg_file) : 0;
+	for (size_t len : {atoms_len, jumps_len, static_cast<size_t>(header.arena_len)}) {
+		valid &= len <= left;
+		left -= valid ? len : 0;
+	}
+	valid &= !left && header.instr_ptr < prog.code.size() && header.mode <= OM_COL && header.rev <= 1;
+	if (!valid) {
+		err("invalid snapshot file!");
+		return false;
+	}
+	
+	char const *data = src->data() + sizeof(header);
+	memcpy(&machine.regs, data, sizeof(reg_file));
+	data += sizeof(reg_file);
+	
+	machine.atoms.resize(header.atoms);
+	machine.jumps.resize(header.jumps);
+	memcpy(machine.atoms.data(), data, atoms_len);
+	memcpy(machine.jumps.data(), data + atoms_len, jumps_len);
+	data += atoms_len + jumps_len;
+	machine.str_arena.assign(data, data + header.arena_len);
+	
+	// everything indexed by the restored state is checked like a program
+	// image. strings in the arena must end within it.
+	for (uint8_t len : machine.regs.lens)
+		valid &= len <= REG_STR_SIZE;
+	bool arena_ended = machine.str_arena.empty() || !machine.str_arena.back();
+	for (atom const &atom : machine.atoms) {
+		if (atom.type == AT_STR)
+			valid &= atom.ref >= 0 && static_cast<size_t>(atom.ref) < prog.strs.size();
+		else if (atom.type == AT_REG_STR)
+			valid &= arena_ended && atom.ref >= 0 && static_cast<size_t>(atom.ref) < machine.str_arena.size();
+		else
+			valid &= atom.type == AT_INT || atom.type == AT_CH;
+	}
+	if (!valid) {
+		err("invalid snapshot file!");
+		return false;
+	}
+	
+	machine.instr_ptr = header.instr_ptr;
+	machine.mask = header.mask;
+	machine.mode = static_cast<op_mode>(header.mode);
+	machine.rev = header.rev;
+	machine.order_dirty = true;
+	
+#ifdef POSIX_IO
+	if (src->data() != buf.data())
+		munmap(const_cast<char *>(src->data()), src->size());
+#endif
+	
+	return true;
+}
+
+// handlers are written once and expanded either into labels jumped to through
+// `labels`, or into the cases of a `switch` in a loop. when `STEP` is set, only
+// a single instruction is executed. `HOOK` is called before every instruction.
+#define HOOK() do { if constexpr (HOOK == EH_PROFILE) prof_count(machine, prog); else if constexpr (HOOK == EH_TRACE) trace_step(machine, prog); else if constexpr (HOOK == EH_SNAPSHOT) snapshot_step(machine, prog); else if constexpr (HOOK == EH_BUDGET) { if (!machine.budget) return; --machine.budget; } } while (0)
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define HANDLE(op) L_##op
+#define NEXT() do { if constexpr (STEP) return; HOOK(); ins = &prog.code[machine.instr_ptr++]; goto *labels[ins->op]; } while (0)
+#else
+#define HANDLE(op) case op
+#define NEXT() do { if constexpr (STEP) return; goto next; } while (0)
+#endif
+
+template<bool STEP, exec_hook HOOK>
+static void
+exec(machine &machine, program const &prog)
+{
+	instr const *ins;
+	reg_file &regs = machine.regs;
+	
+#ifdef THREADED_DISPATCH
+	// indexed by opcode. all mask toggles share a handler with `OP_XOR_MASK`.
+	static void *const labels[] = {
+		&&L_OP_LIT_STR,
+		&&L_OP_LIT_CH,
+		&&L_OP_LIT_NUM,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_MODE_COL,
+		&&L_OP_MODE_ROW,
+		&&L_OP_ORDER_REV,
+		&&L_OP_POP_ATOM,
+		&&L_OP_PUSH_ATOM,
+		&&L_OP_WRITE_STDOUT,
+		&&L_OP_WRITE_STDOUT_NEWLINE,
+		&&L_OP_READ_STDIN,
+		&&L_OP_STR_TO_INT,
+		&&L_OP_INT_TO_STR,
+		&&L_OP_ADD,
+		&&L_OP_SUB,
+		&&L_OP_MUL,
+		&&L_OP_DIV,
+		&&L_OP_NUM_ADD,
+		&&L_OP_NUM_SUB,
+		&&L_OP_NUM_MUL,
+		&&L_OP_NUM_DIV,
+		&&L_OP_IND_ADD,
+		&&L_OP_IND_SUB,
+		&&L_OP_IND_MUL,
+		&&L_OP_IND_DIV,
+		&&L_OP_POP_JMP,
+		&&L_OP_POP_JMP_COND,
+		&&L_OP_PUSH_JMP,
+		&&L_OP_SAVE_JMP,
+		&&L_OP_EQUAL,
+		&&L_OP_GREQUAL,
+		&&L_OP_GREATER,
+		&&L_OP_LESS,
+		&&L_OP_LEQUAL,
+		&&L_OP_AND,
+		&&L_OP_OR,
+		&&L_OP_NOT,
+		&&L_OP_TOGGLE_BIT_0,
+		&&L_OP_POP_IMM,
+		&&L_OP_ADD_IMM,
+		&&L_OP_SUB_IMM,
+		&&L_OP_MUL_IMM,
+		&&L_OP_DIV_IMM,
+		&&L_OP_EQUAL_IMM,
+		&&L_OP_GREQUAL_IMM,
+		&&L_OP_GREATER_IMM,
+		&&L_OP_LESS_IMM,
+		&&L_OP_LEQUAL_IMM,
+		&&L_OP_PUSH_INTS,
+		&&L_OP_WRITE_INTS,
+		&&L_OP_WRITE_INTS_NEWLINE,
+		&&L_OP_NOP,
+		&&L_OP_SET_SEL,
+		&&L_OP_LOOP_HEAD,
+		&&L_OP_BRANCH,
+		&&L_OP_BRANCH_COND,
+		&&L_OP_HALT,
+	};
+	
+	HOOK();
+	ins = &prog.code[machine.instr_ptr++];
+	goto *labels[ins->op];
+#else
+	for (;;) {
+	HOOK();
+	ins = &prog.code[machine.instr_ptr++];
+	switch (ins->op) {
+#endif
+		// handle mask toggles.
+	HANDLE(OP_TOGGLE_BIT_0):
+#ifndef THREADED_DISPATCH
+	HANDLE(OP_TOGGLE_BIT_1): case OP_TOGGLE_BIT_2: case OP_TOGGLE_BIT_3:
+	HANDLE(OP_TOGGLE_BIT_4): case OP_TOGGLE_BIT_5: case OP_TOGGLE_BIT_6:
+	HANDLE(OP_TOGGLE_BIT_7): case OP_TOGGLE_BIT_8: case OP_TOGGLE_BIT_9:
+	HANDLE(OP_TOGGLE_BIT_A): case OP_TOGGLE_BIT_B: case OP_TOGGLE_BIT_C:
+	HANDLE(OP_TOGGLE_BIT_D): case OP_TOGGLE_BIT_E: case OP_TOGGLE_BIT_F:
+	HANDLE(OP_TOGGLE_COL_0): case OP_TOGGLE_COL_1: case OP_TOGGLE_COL_2:
+	HANDLE(OP_TOGGLE_COL_3): case OP_TOGGLE_ROW_0: case OP_TOGGLE_ROW_1:
+	HANDLE(OP_TOGGLE_ROW_2): case OP_TOGGLE_ROW_3: case OP_TOGGLE_MAT:
+	HANDLE(OP_XOR_MASK):
+#endif
+		machine.mask ^= ins->arg;
+		machine.order_dirty = true;
+		NEXT();
 		
-		// handle literals.
-		if (src[i] == '"') {
-			std::optional<token> tok = lex_string(src, ++i, line);
-			if (!tok)
-				return std::nullopt;
-			toks.push_back(*tok);
-			continue;
-		} else if (src[i] == '\'') {
-			std::optional<token> tok = lex_char(src, ++i, line);
-			if (!tok)
-				return std::nullopt;
-			toks.push_back(*tok);
-			continue;
-		} else if (src[i] == '$') {
-			std::optional<token> tok = lex_num(src, ++i, line);
-			if (!tok)
-				return std::nullopt;
-			toks.push_back(*tok);
-			continue;
-		}
+		// handle atoms.
+	HANDLE(OP_LIT_STR): {
+		atom atom = {
+			.type = AT_STR,
+			.ref = ins->arg,
+			.num = prog.str_nums[ins->arg],
+		};
+		machine.atoms.push_back(atom);
+		NEXT();
+	}
+	HANDLE(OP_LIT_CH): {
+		// numerically, a character atom is worth its digit value, if any.
+		char ch = ins->arg;
+		atom atom = {
+			.type = AT_CH,
+			.ref = ch,
+			.num = ch >= '0' && ch <= '9' ? ch - '0' : 0,
+		};
+		machine.atoms.push_back(atom);
+		NEXT();
+	}
+	HANDLE(OP_LIT_NUM): {
+		atom atom = {
+			.type = AT_INT,
+			.ref = 0,
+			.num = ins->arg,
+		};
+		machine.atoms.push_back(atom);
+		NEXT();
+	}
+		
+		// handle operator modes.
+	HANDLE(OP_MODE_COL):
+		machine.mode = OM_COL;
+		machine.order_dirty = true;
+		NEXT();
+	HANDLE(OP_MODE_ROW):
+		machine.mode = OM_ROW;
+		machine.order_dirty = true;
+		NEXT();
+	HANDLE(OP_ORDER_REV):
+		machine.rev = !machine.rev;
+		machine.order_dirty = true;
+		NEXT();
+		
+		// handle operators.
+	HANDLE(OP_POP_ATOM): {
+		if (!machine.atoms.size())
+			NEXT();
 		
-		// handle register mask operations.
-		if (src[i] >= '0' && src[i] <= '9') {
-			token tok = {
-				.type = static_cast<token_type>(TT_TOGGLE_BIT_0 + src[i] - '0'),
-				.data = "",
-				.line = line,
+		atom const &atom = machine.atoms.back();
+		if (atom.type == AT_STR || atom.type == AT_REG_STR) {
+			char padded[REG_STR_SIZE];
+			size_t len = std::min<size_t>(pad_str(atom_str(machine, prog, atom), padded), REG_STR_SIZE);
+			auto pop = [&](size_t num) {
+				memcpy(regs.strs[num], padded, REG_STR_SIZE);
+				regs.lens[num] = len;
 			};
-			toks.push_back(tok);
-			continue;
-		} else if (src[i] >= 'a' && src[i] <= 'f') {
-			token tok = {
-				.type = static_cast<token_type>(TT_TOGGLE_BIT_A + src[i] - 'a'),
-				.data = "",
-				.line = line,
+			for_each_reg(machine, pop);
+			regs.ints &= ~machine.mask;
+		} else {
+			// character atoms are stored as their character code.
+			long val = atom.type == AT_CH ? static_cast<char>(atom.ref) : atom.num;
+			auto pop = [&](size_t num) {
+				regs.nums[num] = val;
 			};
-			toks.push_back(tok);
-			continue;
-		} else if (src[i] == '|') {
-			if (i++ == src.length() - 1) {
-				prog_err(line, "expected column number after '|'!");
-				return std::nullopt;
-			}
-			if (src[i] < '0' || src[i] > '3') {
-				prog_err(line, "invalid column number!");
-				return std::nullopt;
-			}
-			token tok = {
-				.type = static_cast<token_type>(TT_TOGGLE_COL_0 + src[i] - '0'),
-				.data = "",
-				.line = line,
+			for_each_reg(machine, pop);
+			regs.ints |= machine.mask;
+		}
+		pop_atom(machine);
+		
+		NEXT();
+	}
+	HANDLE(OP_PUSH_ATOM): {
+		auto push = [&](size_t num) {
+			atom atom = {
+				.type = AT_INT,
+				.ref = 0,
 			};
-			toks.push_back(tok);
-			continue;
-		} else if (src[i] == '`') {
-			if (i++ == src.length() - 1) {
-				prog_err(line, "expected row number after '`'!");
-				return std::nullopt;
-			}
-			if (src[i] < '0' || src[i] > '3') {
-				prog_err(line, "invalid row number!");
-				return std::nullopt;
+			
+			if (regs.ints & 1 << num) {
+				// integers only keep `int` precision on the atom stack.
+				atom.num = static_cast<int>(regs.nums[num]);
+			} else {
+				size_t len = regs.lens[num];
+				atom.type = AT_REG_STR;
+				atom.ref = machine.str_arena.size();
+				machine.str_arena.insert(machine.str_arena.end(), regs.strs[num], regs.strs[num] + len);
+				machine.str_arena.push_back(0);
+				atom.num = parse_int(regs.strs[num], len);
 			}
-			token tok = {
-				.type = static_cast<token_type>(TT_TOGGLE_ROW_0 + src[i] - '0'),
-				.data = "",
-				.line = line,
+			
+			machine.atoms.push_back(atom);
+		};
+		for_each_reg(machine, push);
+		NEXT();
+	}
+	HANDLE(OP_WRITE_STDOUT): {
+		std::chrono::steady_clock::time_point start;
+		if constexpr (HOOK == EH_PROFILE)
+			start = prof_now(machine);
+		
+		auto write = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				sink_num(machine.out, regs.nums[num]);
+			else
+				sink_write(machine.out, regs.strs[num], regs.lens[num]);
+		};
+		for_each_reg(machine, write);
+		
+		if constexpr (HOOK == EH_PROFILE)
+			prof_io(machine, start);
+		NEXT();
+	}
+	HANDLE(OP_WRITE_STDOUT_NEWLINE): {
+		std::chrono::steady_clock::time_point start;
+		if constexpr (HOOK == EH_PROFILE)
+			start = prof_now(machine);
+		
+		auto write = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				sink_num(machine.out, regs.nums[num]);
+			else
+				sink_write(machine.out, regs.strs[num], regs.lens[num]);
+			sink_write(machine.out, "\n", 1);
+		};
+		for_each_reg(machine, write);
+		
+		if constexpr (HOOK == EH_PROFILE)
+			prof_io(machine, start);
+		NEXT();
+	}
+	HANDLE(OP_READ_STDIN): {
+		std::chrono::steady_clock::time_point start;
+		if constexpr (HOOK == EH_PROFILE)
+			start = prof_now(machine);
+		
+		char word[REG_STR_SIZE];
+		if (machine.in.batch)
+			source_word(machine.in, word);
+		else {
+			// the prompt has to be visible before blocking on input.
+			std::string input;
+			sink_write(machine.out, ">: ", 3);
+			sink_flush(machine.out);
+			std::cin >> input;
+			size_t copied = input.copy(word, REG_STR_SIZE);
+			memset(word + copied, 0, REG_STR_SIZE - copied);
+		}
+		
+		// input may hold null bytes, which end the string.
+		size_t len = strnlen(word, REG_STR_SIZE);
+		memset(word + len, 0, REG_STR_SIZE - len);
+		auto write_input = [&](size_t num) {
+			memcpy(regs.strs[num], word, REG_STR_SIZE);
+			regs.lens[num] = len;
+		};
+		
+		for_each_reg(machine, write_input);
+		regs.ints &= ~machine.mask;
+		
+		if constexpr (HOOK == EH_PROFILE)
+			prof_io(machine, start);
+		NEXT();
+	}
+	HANDLE(OP_STR_TO_INT): {
+		auto str_to_int = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				return;
+			
+			regs.nums[num] = parse_int(regs.strs[num], regs.lens[num]);
+		};
+		for_each_reg(machine, str_to_int);
+		regs.ints |= machine.mask;
+		NEXT();
+	}
+	HANDLE(OP_INT_TO_STR): {
+		auto int_to_str = [&](size_t num) {
+			if (!(regs.ints & 1 << num))
+				return;
+			
+			// like `strncpy()`, the rest of the register is zeroed.
+			char *end = std::to_chars(regs.strs[num], regs.strs[num] + REG_STR_SIZE, regs.nums[num]).ptr;
+			memset(end, 0, regs.strs[num] + REG_STR_SIZE - end);
+			regs.lens[num] = end - regs.strs[num];
+		};
+		for_each_reg(machine, int_to_str);
+		regs.ints &= ~machine.mask;
+		NEXT();
+	}
+	HANDLE(OP_ADD): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_ADD, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_SUB): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_SUB, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_MUL): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_MUL, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_DIV): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		
+		// division by zero not allowed.
+		if (val == 0)
+			NEXT();
+		
+		auto div = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				regs.nums[num] /= val;
+		};
+		
+		for_each_reg(machine, div);
+		
+		NEXT();
+	}
+	HANDLE(OP_NUM_ADD):
+		vec_apply(machine, VO_ADD, reg_nums);
+		NEXT();
+	HANDLE(OP_NUM_SUB):
+		vec_apply(machine, VO_SUB, reg_nums);
+		NEXT();
+	HANDLE(OP_NUM_MUL):
+		vec_apply(machine, VO_MUL, reg_nums);
+		NEXT();
+	HANDLE(OP_NUM_DIV): {
+		auto num_div = [&](size_t num) {
+			if (regs.ints & 1 << num && num > 0)
+				regs.nums[num] /= num;
+		};
+		for_each_reg(machine, num_div);
+		NEXT();
+	}
+	HANDLE(OP_IND_ADD):
+		vec_apply(machine, VO_ADD, order_positions(machine));
+		NEXT();
+	HANDLE(OP_IND_SUB):
+		vec_apply(machine, VO_SUB, order_positions(machine));
+		NEXT();
+	HANDLE(OP_IND_MUL):
+		vec_apply(machine, VO_MUL, order_positions(machine));
+		NEXT();
+	HANDLE(OP_IND_DIV): {
+		size_t ind = 0;
+		auto ind_div = [&](size_t num) {
+			if (regs.ints & 1 << num && ind > 0)
+				regs.nums[num] /= ind;
+			++ind;
+		};
+		for_each_reg(machine, ind_div);
+		NEXT();
+	}
+	HANDLE(OP_POP_JMP): {
+		if (!machine.jumps.size())
+			NEXT();
+		
+		long jmp = machine.jumps.back();
+		machine.jumps.pop_back();
+		if (jmp < 0 || static_cast<size_t>(jmp) >= prog.remap.size() - 1)
+			NEXT();
+		
+		machine.instr_ptr = prog.remap[jmp];
+		
+		NEXT();
+	}
+	HANDLE(OP_POP_JMP_COND): {
+		if (!machine.jumps.size() || !machine.atoms.size())
+			NEXT();
+		
+		long jmp = machine.jumps.back();
+		long cond = machine.atoms.back().num;
+		machine.jumps.pop_back();
+		pop_atom(machine);
+		if (jmp < 0 || static_cast<size_t>(jmp) >= prog.remap.size() - 1)
+			NEXT();
+		
+		if (cond)
+			machine.instr_ptr = prog.remap[jmp];
+		
+		NEXT();
+	}
+	HANDLE(OP_PUSH_JMP): {
+		auto push_jmp = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				machine.jumps.push_back(regs.nums[num]);
+		};
+		for_each_reg(machine, push_jmp);
+		NEXT();
+	}
+	HANDLE(OP_SAVE_JMP):
+		// jumps are by unoptimized instruction index.
+		machine.jumps.push_back(ins->arg);
+		NEXT();
+	HANDLE(OP_EQUAL): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		atom const &atom = machine.atoms.back();
+		if (atom.type == AT_INT)
+			vec_apply_val(machine, VO_EQUAL, atom.num);
+		else if (atom.type == AT_STR || atom.type == AT_REG_STR) {
+			// a string too long for a register equals none of them.
+			char padded[REG_STR_SIZE];
+			size_t len = pad_str(atom_str(machine, prog, atom), padded);
+			uint16_t same = len > REG_STR_SIZE ? 0 : match_strs(regs, padded, len);
+			auto equal = [&](size_t num) {
+				if (!(regs.ints & 1 << num))
+					regs.nums[num] = same >> num & 1;
 			};
-			toks.push_back(tok);
-			continue;
-		} else if (src[i] == 'A') {
-			token tok = {
-				.type = TT_TOGGLE_MAT,
-				.data = "",
-				.line = line,
+			for_each_reg(machine, equal);
+			regs.ints |= machine.mask;
+		}
+		pop_atom(machine);
+		
+		NEXT();
+	}
+	HANDLE(OP_GREQUAL): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_GREQUAL, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_GREATER): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_GREATER, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_LESS): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_LESS, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_LEQUAL): {
+		if (!machine.atoms.size())
+			NEXT();
+		
+		long val = machine.atoms.back().num;
+		pop_atom(machine);
+		vec_apply_val(machine, VO_LEQUAL, val);
+		
+		NEXT();
+	}
+	HANDLE(OP_AND): {
+		bool all_set = true;
+		auto and_ = [&](size_t num) {
+			if (regs.ints & 1 << num && !regs.nums[num])
+				all_set = false;
+		};
+		for_each_reg(machine, and_);
+		
+		atom atom = {
+			.type = AT_INT,
+			.ref = 0,
+			.num = all_set,
+		};
+		machine.atoms.push_back(atom);
+		
+		NEXT();
+	}
+	HANDLE(OP_OR): {
+		bool any_set = false;
+		auto or_ = [&](size_t num) {
+			if (regs.ints & 1 << num && regs.nums[num])
+				any_set = true;
+		};
+		for_each_reg(machine, or_);
+		
+		atom atom = {
+			.type = AT_INT,
+			.ref = 0,
+			.num = any_set,
+		};
+		machine.atoms.push_back(atom);
+		
+		NEXT();
+	}
+	HANDLE(OP_NOT):
+		// `!x` is `x == 0`.
+		vec_apply(machine, VO_EQUAL, reg_zeros);
+		NEXT();
+		
+		// handle operators with an immediate operand.
+	HANDLE(OP_POP_IMM): {
+		long val = ins->arg;
+		auto pop = [&](size_t num) {
+			regs.nums[num] = val;
+		};
+		for_each_reg(machine, pop);
+		regs.ints |= machine.mask;
+		NEXT();
+	}
+	HANDLE(OP_ADD_IMM):
+		vec_apply_val(machine, VO_ADD, ins->arg);
+		NEXT();
+	HANDLE(OP_SUB_IMM):
+		vec_apply_val(machine, VO_SUB, ins->arg);
+		NEXT();
+	HANDLE(OP_MUL_IMM):
+		vec_apply_val(machine, VO_MUL, ins->arg);
+		NEXT();
+	HANDLE(OP_DIV_IMM): {
+		long val = ins->arg;
+		if (val == 0)
+			NEXT();
+		
+		auto div = [&](size_t num) {
+			if (regs.ints & 1 << num)
+				regs.nums[num] /= val;
+		};
+		for_each_reg(machine, div);
+		
+		NEXT();
+	}
+	HANDLE(OP_EQUAL_IMM):
+		vec_apply_val(machine, VO_EQUAL, ins->arg);
+		NEXT();
+	HANDLE(OP_GREQUAL_IMM):
+		vec_apply_val(machine, VO_GREQUAL, ins->arg);
+		NEXT();
+	HANDLE(OP_GREATER_IMM):
+		vec_apply_val(machine, VO_GREATER, ins->arg);
+		NEXT();
+	HANDLE(OP_LESS_IMM):
+		vec_apply_val(machine, VO_LESS, ins->arg);
+		NEXT();
+	HANDLE(OP_LEQUAL_IMM):
+		vec_apply_val(machine, VO_LEQUAL, ins->arg);
+		NEXT();
+		
+		// handle operators specialized by `specialize_types()`, where every
+		// selected register is known to hold an integer or a conversion is
+		// known to change nothing.
+	HANDLE(OP_PUSH_INTS): {
+		auto push = [&](size_t num) {
+			atom atom = {
+				.type = AT_INT,
+				.ref = 0,
+				.num = static_cast<int>(regs.nums[num]),
 			};
-			toks.push_back(tok);
-			continue;
+			machine.atoms.push_back(atom);
+		};
+		for_each_reg(machine, push);
+		NEXT();
+	}
+	HANDLE(OP_WRITE_INTS): {
+		std::chrono::steady_clock::time_point start;
+		if constexpr (HOOK == EH_PROFILE)
+			start = prof_now(machine);
+		
+		auto write = [&](size_t num) {
+			sink_num(machine.out, regs.nums[num]);
+		};
+		for_each_reg(machine, write);
+		
+		if constexpr (HOOK == EH_PROFILE)
+			prof_io(machine, start);
+		NEXT();
+	}
+	HANDLE(OP_WRITE_INTS_NEWLINE): {
+		std::chrono::steady_clock::time_point start;
+		if constexpr (HOOK == EH_PROFILE)
+			start = prof_now(machine);
+		
+		auto write = [&](size_t num) {
+			sink_num(machine.out, regs.nums[num]);
+			sink_write(machine.out, "\n", 1);
+		};
+		for_each_reg(machine, write);
+		
+		if constexpr (HOOK == EH_PROFILE)
+			prof_io(machine, start);
+		NEXT();
+	}
+	HANDLE(OP_NOP):
+		NEXT();
+		
+		// handle mask, mode and order changes resolved by
+		// `specialize_sels()`, which come with the registers they select.
+	HANDLE(OP_SET_SEL): {
+		reg_sel const &sel = prog.sels[ins->arg];
+		machine.mask = sel.mask;
+		machine.mode = sel.mode;
+		machine.rev = sel.rev;
+		machine.order_len = sel.order_len;
+		memcpy(machine.order, sel.order, sizeof(sel.order));
+		memcpy(machine.positions, sel.positions, sizeof(sel.positions));
+		machine.order_dirty = false;
+		NEXT();
+	}
+		
+		// handle loops resolved by `resolve_loops()`. the loop head only
+		// matters to jumps not known to be going there, so branches skip it.
+	HANDLE(OP_LOOP_HEAD):
+		NEXT();
+	HANDLE(OP_BRANCH):
+		machine.instr_ptr = ins->arg + 1;
+		NEXT();
+	HANDLE(OP_BRANCH_COND): {
+		// without an atom to pop, the jump is left on the stack as if the
+		// loop head had pushed it.
+		if (!machine.atoms.size()) {
+			machine.jumps.push_back(prog.code[ins->arg].arg);
+			NEXT();
 		}
 		
-		token_type type;
-		switch (src[i]) {
-			// handle operator modes.
-		case 'C':
-			type = TT_OP_MODE_COL;
-			break;
-		case 'R':
-			type = TT_OP_MODE_ROW;
-			break;
-		case '~':
-			type = TT_OP_ORDER_REV;
-			break;
-			
-			// handle operators.
-		case '>':
-			type = TT_POP_ATOM;
-			break;
-		case '<':
-			type = TT_PUSH_ATOM;
-			break;
-		case 'w':
-			type = TT_WRITE_STDOUT;
+		long cond = machine.atoms.back().num;
+		pop_atom(machine);
+		if (cond)
+			machine.instr_ptr = ins->arg + 1;
+		
+		NEXT();
+	}
+		
+	HANDLE(OP_HALT):
+		--machine.instr_ptr;
+		return;
+#ifndef THREADED_DISPATCH
+	}
+	next:;
+	}
+#endif
+}
+
+#undef HOOK
+#undef HANDLE
+#undef NEXT
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+static std::vector<int32_t>
+pair_loops(program const &prog)
+{
+	size_t len = prog.code.size() - 1;
+	std::vector<int32_t> pairs(len, -1);
+	
+	// `j<` can send execution anywhere, in which case nothing is provable.
+	for (instr const &ins : prog.code) {
+		if (ins.op == OP_PUSH_JMP)
+			return pairs;
+	}
+	
+	// a `.` followed by a `j>` or `j?` with no other jump stack operations in
+	// between must be what the jump pops, since the only way into the code
+	// between them is through the `.`.
+	int32_t save = -1;
+	for (size_t i = 0; i < len; ++i) {
+		switch (prog.code[i].op) {
+		case OP_SAVE_JMP:
+			save = i;
 			break;
-		case 'W':
-			type = TT_WRITE_STDOUT_NEWLINE;
+		case OP_POP_JMP:
+		case OP_POP_JMP_COND:
+			pairs[i] = save;
+			save = -1;
 			break;
-		case 'r':
-			type = TT_READ_STDIN;
+		default:
 			break;
-		case '#':
-			type = TT_STR_TO_INT;
+		}
+	}
+	
+	return pairs;
+}
+
+static void
+resolve_loops(program &prog)
+{
+	std::vector<int32_t> pairs = pair_loops(prog);
+	for (size_t i = 0; i < pairs.size(); ++i) {
+		if (pairs[i] < 0)
+			continue;
+		
+		prog.code[pairs[i]].op = OP_LOOP_HEAD;
+		prog.code[i] = instr{
+			.op = prog.code[i].op == OP_POP_JMP ? OP_BRANCH : OP_BRANCH_COND,
+			.arg = pairs[i],
+		};
+	}
+}
+
+// sizes the stacks for everything pushed in a single pass over the program,
+// which covers the fan-out of any one loop body. pushes from every selected
+// register count for all 16 where the mask is not known statically.
+static void
+size_stacks(program &prog)
+{
+	std::vector<flow_state> states = analyze_flow(prog);
+	size_t atoms = 0, jumps = 0, reg_strs = 0;
+	for (size_t i = 0; i + 1 < prog.code.size(); ++i) {
+		if (!states[i].reached)
+			continue;
+		size_t regs = states[i].known ? std::popcount(states[i].mask) : 16;
+		
+		switch (prog.code[i].op) {
+		case OP_LIT_STR:
+		case OP_LIT_CH:
+		case OP_LIT_NUM:
+		case OP_AND:
+		case OP_OR:
+			++atoms;
 			break;
-		case ',':
-			type = TT_INT_TO_STR;
+		case OP_PUSH_ATOM:
+			atoms += regs;
+			reg_strs += regs;
 			break;
-		case '+':
-			type = TT_ADD;
+		case OP_PUSH_INTS:
+			atoms += regs;
 			break;
-		case '-':
-			type = TT_SUB;
+		case OP_PUSH_JMP:
+			jumps += regs;
 			break;
-		case '*':
-			type = TT_MUL;
+		case OP_SAVE_JMP:
+		case OP_BRANCH_COND:
+			++jumps;
 			break;
-		case '/':
-			type = TT_DIV;
+		default:
 			break;
-		case '%':
-			if (++i == src.length()) {
-				prog_err(line, "expected register number operator after '%'!");
-				return std::nullopt;
-			}
-			switch (src[i]) {
-			case '+':
-				type = TT_NUM_ADD;
-				break;
-			case '-':
-				type = TT_NUM_SUB;
-				break;
-			case '*':
-				type = TT_NUM_MUL;
-				break;
-			case '/':
-				type = TT_NUM_DIV;
-				break;
-			default:
-				prog_err(line, "invalid register number operator!");
-				return std::nullopt;
-			}
+		}
+	}
+	
+	prog.atoms_reserve = std::min<size_t>(atoms, STACK_RESERVE_MAX);
+	prog.jumps_reserve = std::min<size_t>(jumps, STACK_RESERVE_MAX);
+	prog.arena_reserve = std::min<size_t>(reg_strs, STACK_RESERVE_MAX) * (REG_STR_SIZE + 1);
+}
+
+static void
+reserve_stacks(machine &machine, program const &prog)
+{
+	machine.atoms.reserve(prog.atoms_reserve);
+	machine.jumps.reserve(prog.jumps_reserve);
+	machine.str_arena.reserve(prog.arena_reserve);
+}
+
+static bool
+join_flow(flow_state &dst, flow_state const &src)
+{
+	if (!src.reached)
+		return false;
+	
+	if (!dst.reached) {
+		dst = src;
+		return true;
+	}
+	
+	flow_state old = dst;
+	bool same = src.known && src.mask == dst.mask && src.mode == dst.mode && src.rev == dst.rev;
+	dst.known &= same;
+	dst.ints &= src.ints;
+	dst.strs &= src.strs;
+	if (dst.top != src.top)
+		dst.top = std::nullopt;
+	
+	return dst.known != old.known || dst.ints != old.ints || dst.strs != old.strs || dst.top != old.top;
+}
+
+static std::vector<flow_state>
+analyze_flow(program const &prog)
+{
+	size_t len = prog.code.size() - 1;
+	std::vector<flow_state> states(len + 1, flow_state{});
+	
+	std::vector<size_t> saves;
+	for (size_t i = 0; i < len; ++i) {
+		if (prog.code[i].op == OP_PUSH_JMP) {
+			flow_state unknown = {
+				.reached = true,
+				.known = false,
+			};
+			std::fill(states.begin(), states.end(), unknown);
+			return states;
+		} else if (prog.code[i].op == OP_SAVE_JMP || prog.code[i].op == OP_LOOP_HEAD)
+			saves.push_back(i);
+	}
+	
+	// dynamic jumps may land on any `.`, so the states they leave with are
+	// collected into `dyn` and joined into every `.`.
+	flow_state dyn = {};
+	std::vector<size_t> work;
+	auto flow_to = [&](size_t i, flow_state const &state) {
+		if (join_flow(states[i], state))
+			work.push_back(i);
+	};
+	
+	states[0] = {
+		.reached = true,
+		.known = true,
+		.mask = 0x0,
+		.mode = OM_ROW,
+		.rev = false,
+		.ints = 0x0,
+		.strs = 0xffff,
+		.top = std::nullopt,
+	};
+	work.push_back(0);
+	
+	while (!work.empty()) {
+		size_t i = work.back();
+		work.pop_back();
+		if (i == len)
+			continue;
+		
+		instr const &ins = prog.code[i];
+		flow_state out = states[i];
+		if ((ins.op >= OP_TOGGLE_BIT_0 && ins.op <= OP_TOGGLE_MAT) || ins.op == OP_XOR_MASK)
+			out.mask ^= ins.arg;
+		else if (ins.op == OP_MODE_COL)
+			out.mode = OM_COL;
+		else if (ins.op == OP_MODE_ROW)
+			out.mode = OM_ROW;
+		else if (ins.op == OP_ORDER_REV)
+			out.rev = !out.rev;
+		else if (ins.op == OP_SET_SEL) {
+			reg_sel const &sel = prog.sels[ins.arg];
+			out.known = true;
+			out.mask = sel.mask;
+			out.mode = sel.mode;
+			out.rev = sel.rev;
+		}
+		
+		// registers converted to one type stay of the other type only if
+		// certainly not selected. without a known mask, any register may be.
+		uint16_t sel = states[i].known ? states[i].mask : 0xffff;
+		uint16_t set = states[i].known ? states[i].mask : 0x0;
+		auto to_ints = [&] {
+			out.ints |= set;
+			out.strs &= ~sel;
+		};
+		auto to_strs = [&] {
+			out.strs |= set;
+			out.ints &= ~sel;
+		};
+		
+		switch (ins.op) {
+		case OP_POP_IMM:
+		case OP_STR_TO_INT:
+			to_ints();
 			break;
-		case '[':
-			if (++i == src.length()) {
-				prog_err(line, "expected register index operator after '['!");
-				return std::nullopt;
-			}
-			switch (src[i]) {
-			case '+':
-				type = TT_IND_ADD;
-				break;
-			case '-':
-				type = TT_IND_SUB;
-				break;
-			case '*':
-				type = TT_IND_MUL;
-				break;
-			case '/':
-				type = TT_IND_DIV;
-				break;
-			default:
-				prog_err(line, "invalid register index operator!");
-				return std::nullopt;
-			}
+		case OP_READ_STDIN:
+		case OP_INT_TO_STR:
+			to_strs();
 			break;
-		case 'j':
-			if (++i == src.length()) {
-				prog_err(line, "expected jump stack operator after 'j'!");
-				return std::nullopt;
-			}
-			switch (src[i]) {
-			case '>':
-				type = TT_POP_JMP;
-				break;
-			case '?':
-				type = TT_POP_JMP_COND;
-				break;
-			case '<':
-				type = TT_PUSH_JMP;
-				break;
-			default:
-				prog_err(line, "invalid jump stack operator!");
-				return std::nullopt;
+		case OP_POP_ATOM:
+			// with nothing known about the atom, or nothing to pop, the
+			// registers may be left as they are or become either type.
+			if (out.top == AT_STR)
+				to_strs();
+			else if (out.top)
+				to_ints();
+			else {
+				out.ints &= ~sel;
+				out.strs &= ~sel;
 			}
 			break;
-		case '.':
-			type = TT_SAVE_JMP;
+		case OP_EQUAL:
+			// only a string atom turns string registers into integers.
+			if (out.top != AT_INT && out.top != AT_CH)
+				out.strs &= ~sel;
+			break;
+		default:
+			break;
+		}
+		
+		switch (ins.op) {
+		case OP_LIT_STR:
+			out.top = AT_STR;
 			break;
-		case '=':
-			type = TT_EQUAL;
+		case OP_LIT_CH:
+			out.top = AT_CH;
 			break;
-		case 'F':
-			type = TT_GREQUAL;
+		case OP_LIT_NUM:
+		case OP_AND:
+		case OP_OR:
+			out.top = AT_INT;
 			break;
-		case 'G':
-			type = TT_GREATER;
+		case OP_POP_ATOM:
+		case OP_PUSH_ATOM:
+		case OP_PUSH_INTS:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_POP_JMP_COND:
+		case OP_BRANCH_COND:
+		case OP_EQUAL:
+		case OP_GREQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_LEQUAL:
+			out.top = std::nullopt;
 			break;
-		case 'L':
-			type = TT_LESS;
+		default:
 			break;
-		case 'M':
-			type = TT_LEQUAL;
+		}
+		
+		switch (ins.op) {
+		case OP_BRANCH:
+			flow_to(ins.arg, out);
 			break;
-		case '&':
-			type = TT_AND;
+		case OP_BRANCH_COND:
+			flow_to(ins.arg, out);
+			flow_to(i + 1, out);
 			break;
-		case '?':
-			if (++i == src.length()) {
-				prog_err(line, "expected '|' after '?'!");
-				break;
-			}
-			switch (src[i]) {
-			case '|':
-				type = TT_OR;
-				break;
-			default:
-				prog_err(line, "invalid boolean operator!");
-				return std::nullopt;
+		case OP_POP_JMP:
+		case OP_POP_JMP_COND:
+			flow_to(i + 1, out);
+			if (join_flow(dyn, out)) {
+				for (size_t save : saves)
+					flow_to(save, dyn);
 			}
 			break;
-		case '!':
-			type = TT_NOT;
-			break;
-			
 		default:
-			prog_err(line, "unknown character!");
-			return std::nullopt;
+			flow_to(i + 1, out);
+			break;
 		}
-		
-		token tok = {
-			.type = type,
-			.data = "",
-			.line = line,
-		};
-		toks.push_back(tok);
 	}
 	
-	return toks;
+	return states;
+}
+
+// whether every register selected before an instruction is known to be of the
+// types in `types`.
+static bool
+sel_typed(flow_state const &state, uint16_t types)
+{
+	if (!state.known)
+		return types == 0xffff;
+	return !(state.mask & ~types);
 }
 
+// rewrites operators into variants without type checks where the types of the
+// selected registers are known, and conversions that change nothing into
+// no-ops.
 static void
-for_each_reg(machine &machine, std::function<void(reg &, size_t)> const &fn)
+specialize_types(program &prog)
 {
-	auto maybe_apply = [&](int ind) {
-		if (machine.mask & 1 << ind)
-			fn(machine.regs[ind], ind);
-	};
-	
-	if (!machine.rev) {
-		if (machine.mode == OM_ROW) {
-			for (int i = 0; i < 4; ++i) {
-				maybe_apply(4 * i);
-				maybe_apply(4 * i + 1);
-				maybe_apply(4 * i + 2);
-				maybe_apply(4 * i + 3);
-			}
-		} else {
-			for (int i = 0; i < 4; ++i) {
-				maybe_apply(i);
-				maybe_apply(i + 4);
-				maybe_apply(i + 8);
-				maybe_apply(i + 12);
-			}
-		}
-	} else {
-		if (machine.mode == OM_ROW) {
-			for (int i = 0; i < 4; ++i) {
-				maybe_apply(4 * i + 3);
-				maybe_apply(4 * i + 2);
-				maybe_apply(4 * i + 1);
-				maybe_apply(4 * i);
-			}
-		} else {
-			for (int i = 0; i < 4; ++i) {
-				maybe_apply(i + 12);
-				maybe_apply(i + 8);
-				maybe_apply(i + 4);
-				maybe_apply(i);
-			}
+	std::vector<flow_state> states = analyze_flow(prog);
+	for (size_t i = 0; i + 1 < prog.code.size(); ++i) {
+		if (!states[i].reached)
+			continue;
+		
+		opcode &op = prog.code[i].op;
+		bool ints = sel_typed(states[i], states[i].ints);
+		bool strs = sel_typed(states[i], states[i].strs);
+		if ((op == OP_STR_TO_INT && ints) || (op == OP_INT_TO_STR && strs))
+			op = OP_NOP;
+		else if (op == OP_PUSH_ATOM && ints)
+			op = OP_PUSH_INTS;
+		else if (op == OP_WRITE_STDOUT && ints)
+			op = OP_WRITE_INTS;
+		else if (op == OP_WRITE_STDOUT_NEWLINE && ints)
+			op = OP_WRITE_INTS_NEWLINE;
+	}
+}
+
+// rewrites mask, mode and order changes made in a known state into ones setting
+// the resulting selection outright, so that the registers it selects are only
+// ever listed here. where states disagree, as past jumps merging different
+// ones, the changes are left to be applied as they run.
+static void
+specialize_sels(program &prog)
+{
+	std::vector<flow_state> states = analyze_flow(prog);
+	std::unordered_map<uint32_t, int32_t> pool;
+	for (size_t i = 0; i + 1 < prog.code.size(); ++i) {
+		instr &ins = prog.code[i];
+		flow_state const &state = states[i];
+		bool toggle = (ins.op >= OP_TOGGLE_BIT_0 && ins.op <= OP_TOGGLE_MAT) || ins.op == OP_XOR_MASK;
+		bool sets = toggle || ins.op == OP_MODE_COL || ins.op == OP_MODE_ROW || ins.op == OP_ORDER_REV;
+		if (!sets || !state.reached || !state.known)
+			continue;
+		
+		reg_sel sel = {
+			.mask = static_cast<uint16_t>(toggle ? state.mask ^ ins.arg : state.mask),
+			.mode = ins.op == OP_MODE_COL ? OM_COL : ins.op == OP_MODE_ROW ? OM_ROW : state.mode,
+			.rev = ins.op == OP_ORDER_REV ? !state.rev : state.rev,
+		};
+		uint32_t key = sel.mask | sel.mode << 16 | sel.rev << 17;
+		auto [it, added] = pool.try_emplace(key, prog.sels.size());
+		if (added) {
+			sel.order_len = order_regs(sel.mask, sel.mode, sel.rev, sel.order, sel.positions);
+			prog.sels.push_back(sel);
 		}
+		
+		ins = instr{
+			.op = OP_SET_SEL,
+			.arg = it->second,
+		};
 	}
 }
 
+#ifdef JIT_X86
+static void
+emit(std::vector<uint8_t> &buf, std::initializer_list<uint8_t> bytes)
+{
+	buf.insert(buf.end(), bytes);
+}
+
+static void
+emit16(std::vector<uint8_t> &buf, uint16_t val)
+{
+	buf.push_back(val);
+	buf.push_back(val >> 8);
+}
+
 static void
-exec_cycle(machine &machine, std::vector<token> const &code)
+emit32(std::vector<uint8_t> &buf, uint32_t val)
 {
-	token const &tok = code[machine.instr_ptr++];
+	for (int i = 0; i < 4; ++i)
+		buf.push_back(val >> 8 * i);
+}
+
+static void
+emit64(std::vector<uint8_t> &buf, uint64_t val)
+{
+	for (int i = 0; i < 8; ++i)
+		buf.push_back(val >> 8 * i);
+}
+
+static void
+jit_step(machine *machine, program const *prog)
+{
+	exec<true>(*machine, *prog);
+}
+
+static int
+jit_pop_cond(machine *machine)
+{
+	if (!machine->atoms.size())
+		return -1;
 	
-	// handle bit toggling since these can easily be implemented without
-	// having to do the ugly thing of defining 25 parallel switch cases for
-	// every possibility.
-	if (tok.type >= TT_TOGGLE_BIT_0 && tok.type <= TT_TOGGLE_BIT_F) {
-		machine.mask ^= 1 << static_cast<int>(tok.type - TT_TOGGLE_BIT_0);
-		return;
-	} else if (tok.type >= TT_TOGGLE_ROW_0 && tok.type <= TT_TOGGLE_ROW_3) {
-		machine.mask ^= 0xf << 4 * static_cast<int>(tok.type - TT_TOGGLE_ROW_0);
-		return;
-	} else if (tok.type >= TT_TOGGLE_COL_0 && tok.type <= TT_TOGGLE_COL_3) {
-		machine.mask ^= 0x1111 << static_cast<int>(tok.type - TT_TOGGLE_COL_0);
-		return;
-	} else if (tok.type == TT_TOGGLE_MAT) {
-		machine.mask ^= 0xffff;
-		return;
-	}
+	long cond = machine->atoms.back().num;
+	pop_atom(*machine);
+	return cond != 0;
+}
+
+static void
+jit_push_jmp(machine *machine, long jmp)
+{
+	machine->jumps.push_back(jmp);
+}
+
+static bool
+jit_inline_op(std::vector<uint8_t> &buf, machine const &machine, flow_state const &state, opcode op, std::optional<long> lit)
+{
+	long val = lit.value_or(0);
+	bool takes_lit = true;
+
+	// register updates in terms of `val`, the register number or its
+	// position in the visiting order.
+	enum {
+		OPND_VAL,
+		OPND_NUM,
+		OPND_POS,
+	} opnd = OPND_VAL;
+	uint8_t cmp = 0;
 	
-	switch (tok.type) {
-		// handle atoms.
-	case TT_LIT_STR:
-	case TT_LIT_CH:
-	case TT_LIT_NUM:
-		machine.atoms.push(tok);
+	switch (op) {
+	case OP_NUM_ADD:
+	case OP_NUM_SUB:
+	case OP_NUM_MUL:
+		opnd = OPND_NUM;
+		takes_lit = false;
 		break;
-		
-		// handle operator modes.
-	case TT_OP_MODE_COL:
-		machine.mode = OM_COL;
+	case OP_IND_ADD:
+	case OP_IND_SUB:
+	case OP_IND_MUL:
+		opnd = OPND_POS;
+		takes_lit = false;
 		break;
-	case TT_OP_MODE_ROW:
-		machine.mode = OM_ROW;
+	case OP_EQUAL:
+		cmp = 0x94;
 		break;
-	case TT_OP_ORDER_REV:
-		machine.rev = !machine.rev;
+	case OP_GREQUAL:
+		cmp = 0x9d;
+		break;
+	case OP_GREATER:
+		cmp = 0x9f;
+		break;
+	case OP_LESS:
+		cmp = 0x9c;
 		break;
+	case OP_LEQUAL:
+		cmp = 0x9e;
+		break;
+	case OP_NOT:
+		cmp = 0x94;
+		takes_lit = false;
+		break;
+	case OP_POP_ATOM:
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+		break;
+	default:
+		return false;
+	}
+	
+	// operators which pop an atom can only be inlined given an immediate
+	// operand.
+	if (takes_lit != lit.has_value())
+		return false;
+	
+	auto field = [&](void const *p) -> uint32_t {
+		return static_cast<char const *>(p) - reinterpret_cast<char const *>(&machine);
+	};
+	
+	// a popped integer overwrites every selected register regardless of type.
+	if (op == OP_POP_ATOM) {
+		for (int i = 0; i < 16; ++i) {
+			if (!(state.mask & 1 << i))
+				continue;
+			emit(buf, {0x48, 0xc7, 0x83}); // mov qword [rbx + num], val
+			emit32(buf, field(&machine.regs.nums[i]));
+			emit32(buf, val);
+		}
+		emit(buf, {0x66, 0x81, 0x8b}); // or word [rbx + ints], mask
+		emit32(buf, field(&machine.regs.ints));
+		emit16(buf, state.mask);
+		return true;
+	}
+	
+	uint8_t const *order = reg_orders[state.mode][state.rev];
+	long pos = 0;
+	for (int j = 0; j < 16; ++j) {
+		int i = order[j];
+		if (!(state.mask & 1 << i))
+			continue;
 		
-		// handle operators.
-	case TT_POP_ATOM: {
-		if (!machine.atoms.size())
-			break;
+		long opnd_val = opnd == OPND_VAL ? val : opnd == OPND_NUM ? i : pos;
+		uint32_t num = field(&machine.regs.nums[i]);
+		++pos;
+		if (state.strs & 1 << i)
+			continue;
 		
-		token tok = machine.atoms.top();
-		machine.atoms.pop();
-		if (tok.type == TT_LIT_STR) {
-			auto pop = [&](reg &reg, size_t num) {
-				reg.type = RT_STR;
-				strncpy(reg.data.str, tok.data.c_str(), REG_STR_SIZE);
-			};
-			for_each_reg(machine, pop);
-		} else if (tok.type == TT_LIT_CH) {
-			auto pop = [&](reg &reg, size_t num) {
-				reg.type = RT_INT;
-				reg.data.num = tok.data[0];
-			};
-			for_each_reg(machine, pop);
+		std::vector<uint8_t> body;
+		if (cmp) {
+			emit(body, {0x48, 0x81, 0xbb}); // cmp qword [rbx + num], val
+			emit32(body, num);
+			emit32(body, opnd_val);
+			emit(body, {0x0f, cmp, 0xc0}); // setcc al
+			emit(body, {0x0f, 0xb6, 0xc0}); // movzx eax, al
+			emit(body, {0x48, 0x89, 0x83}); // mov [rbx + num], rax
+			emit32(body, num);
+		} else if (op == OP_ADD || op == OP_NUM_ADD || op == OP_IND_ADD) {
+			emit(body, {0x48, 0x81, 0x83}); // add qword [rbx + num], val
+			emit32(body, num);
+			emit32(body, opnd_val);
+		} else if (op == OP_SUB || op == OP_NUM_SUB || op == OP_IND_SUB) {
+			emit(body, {0x48, 0x81, 0xab}); // sub qword [rbx + num], val
+			emit32(body, num);
+			emit32(body, opnd_val);
 		} else {
-			auto pop = [&](reg &reg, size_t num) {
-				reg.type = RT_INT;
-				reg.data.num = atoi(tok.data.c_str());
-			};
-			for_each_reg(machine, pop);
+			emit(body, {0x48, 0x69, 0x83}); // imul rax, [rbx + num], val
+			emit32(body, num);
+			emit32(body, opnd_val);
+			emit(body, {0x48, 0x89, 0x83}); // mov [rbx + num], rax
+			emit32(body, num);
 		}
 		
-		break;
+		// only integer registers are affected, which need no test if known
+		// to be one.
+		if (!(state.ints & 1 << i)) {
+			emit(buf, {0x66, 0xf7, 0x83}); // test word [rbx + ints], 1 << i
+			emit32(buf, field(&machine.regs.ints));
+			emit16(buf, 1 << i);
+			emit(buf, {0x74, static_cast<uint8_t>(body.size())}); // jz past body
+		}
+		buf.insert(buf.end(), body.begin(), body.end());
 	}
-	case TT_PUSH_ATOM: {
-		auto push = [&](reg &reg, size_t num) {
-			token tok = {
-				// special value used for non-lexed atom tokens.
-				.line = -1,
-			};
-			
-			if (reg.type == RT_INT) {
-				tok.type = TT_LIT_NUM;
-				tok.data = std::to_string(reg.data.num);
-			} else {
-				tok.type = TT_LIT_STR;
-				char buf[REG_STR_SIZE + 1] = {0};
-				strcpy(buf, reg.data.str);
-				tok.data = std::string{buf};
+	
+	return true;
+}
+
+static bool
+jit_exec(machine &machine, program const &prog)
+{
+	size_t len = prog.code.size() - 1;
+	std::vector<flow_state> states = analyze_flow(prog);
+	
+	auto field = [&](void const *p) -> uint32_t {
+		return static_cast<char const *>(p) - reinterpret_cast<char const *>(&machine);
+	};
+	uint32_t mask = field(&machine.mask);
+	uint32_t instr_ptr = field(&machine.instr_ptr);
+	uint32_t mode = field(&machine.mode);
+	uint32_t rev = field(&machine.rev);
+	uint32_t order_dirty = field(&machine.order_dirty);
+	
+	std::vector<uint8_t> buf;
+	std::vector<size_t> offsets(len + 1);
+	
+	// rel32 operands which are to be patched with the offset of an
+	// instruction, once known.
+	std::vector<std::pair<size_t, size_t>> fixups;
+	auto jump_to = [&](std::initializer_list<uint8_t> op, size_t target) {
+		emit(buf, op);
+		fixups.emplace_back(buf.size(), target);
+		emit32(buf, 0);
+	};
+	
+	// the generated function is called as `fn(machine, prog, table)`. the
+	// machine is kept in rbx, the program in r13 and the table of
+	// instruction addresses in r12. the three pushes also keep the stack
+	// aligned for calls.
+	emit(buf, {0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+	emit(buf, {0x48, 0x89, 0xfb}); // mov rbx, rdi
+	emit(buf, {0x49, 0x89, 0xf5}); // mov r13, rsi
+	emit(buf, {0x49, 0x89, 0xd4}); // mov r12, rdx
+	
+	// entered whenever execution continues at a dynamic instruction pointer.
+	size_t dispatch = buf.size();
+	emit(buf, {0x48, 0x8b, 0x83}); // mov rax, [rbx + instr_ptr]
+	emit32(buf, instr_ptr);
+	emit(buf, {0x41, 0xff, 0x24, 0xc4}); // jmp [r12 + rax * 8]
+	
+	for (size_t i = 0; i < len; ++i) {
+		instr const &ins = prog.code[i];
+		offsets[i] = buf.size();
+		
+		if ((ins.op >= OP_TOGGLE_BIT_0 && ins.op <= OP_TOGGLE_MAT) || ins.op == OP_XOR_MASK) {
+			emit(buf, {0x66, 0x81, 0xb3}); // xor word [rbx + mask], bits
+			emit32(buf, mask);
+			emit16(buf, ins.arg);
+			emit(buf, {0xc6, 0x83}); // mov byte [rbx + order_dirty], 1
+			emit32(buf, order_dirty);
+			emit(buf, {0x01});
+			continue;
+		} else if (ins.op == OP_MODE_COL || ins.op == OP_MODE_ROW) {
+			emit(buf, {0xc7, 0x83}); // mov dword [rbx + mode], mode
+			emit32(buf, mode);
+			emit32(buf, ins.op == OP_MODE_COL ? OM_COL : OM_ROW);
+			emit(buf, {0xc6, 0x83}); // mov byte [rbx + order_dirty], 1
+			emit32(buf, order_dirty);
+			emit(buf, {0x01});
+			continue;
+		} else if (ins.op == OP_ORDER_REV) {
+			emit(buf, {0x80, 0xb3}); // xor byte [rbx + rev], 1
+			emit32(buf, rev);
+			emit(buf, {0x01});
+			emit(buf, {0xc6, 0x83}); // mov byte [rbx + order_dirty], 1
+			emit32(buf, order_dirty);
+			emit(buf, {0x01});
+			continue;
+		} else if (ins.op == OP_SET_SEL) {
+			reg_sel const &sel = prog.sels[ins.arg];
+			emit(buf, {0x66, 0xc7, 0x83}); // mov word [rbx + mask], mask
+			emit32(buf, mask);
+			emit16(buf, sel.mask);
+			emit(buf, {0xc7, 0x83}); // mov dword [rbx + mode], mode
+			emit32(buf, mode);
+			emit32(buf, sel.mode);
+			emit(buf, {0xc6, 0x83}); // mov byte [rbx + rev], rev
+			emit32(buf, rev);
+			emit(buf, {sel.rev});
+			emit(buf, {0xc6, 0x83}); // mov byte [rbx + order_dirty], 1
+			emit32(buf, order_dirty);
+			emit(buf, {0x01});
+			continue;
+		}
+		
+		// resolved loops become native branches. if there is no atom for the
+		// conditional branch to pop, the jump is left on the stack like the
+		// interpreter would.
+		if (ins.op == OP_LOOP_HEAD)
+			continue;
+		else if (ins.op == OP_BRANCH) {
+			jump_to({0xe9}, ins.arg); // jmp head
+			continue;
+		} else if (ins.op == OP_BRANCH_COND) {
+			emit(buf, {0x48, 0x89, 0xdf}); // mov rdi, rbx
+			emit(buf, {0x48, 0xb8}); // mov rax, jit_pop_cond
+			emit64(buf, reinterpret_cast<uint64_t>(&jit_pop_cond));
+			emit(buf, {0xff, 0xd0}); // call rax
+			emit(buf, {0x85, 0xc0}); // test eax, eax
+			jump_to({0x0f, 0x8f}, ins.arg); // jg head
+			jump_to({0x0f, 0x84}, i + 1); // je next
+			emit(buf, {0x48, 0x89, 0xdf}); // mov rdi, rbx
+			emit(buf, {0x48, 0xc7, 0xc6}); // mov rsi, save
+			emit32(buf, prog.code[ins.arg].arg);
+			emit(buf, {0x48, 0xb8}); // mov rax, jit_push_jmp
+			emit64(buf, reinterpret_cast<uint64_t>(&jit_push_jmp));
+			emit(buf, {0xff, 0xd0}); // call rax
+			continue;
+		}
+		
+		// register updates are applied directly when the selected registers
+		// are known.
+		opcode op = ins.op;
+		std::optional<long> lit;
+		for (auto [base, imm] : imm_ops) {
+			if (ins.op == imm) {
+				op = base;
+				lit = ins.arg;
 			}
-			
-			machine.atoms.push(tok);
-		};
-		for_each_reg(machine, push);
-		break;
+		}
+		if (states[i].known && jit_inline_op(buf, machine, states[i], op, lit))
+			continue;
+		
+		// everything else is executed by the interpreter, after which
+		// execution resumes through `dispatch` if it didn't just move on to
+		// the next instruction.
+		emit(buf, {0x48, 0xc7, 0x83}); // mov qword [rbx + instr_ptr], i
+		emit32(buf, instr_ptr);
+		emit32(buf, i);
+		emit(buf, {0x48, 0x89, 0xdf}); // mov rdi, rbx
+		emit(buf, {0x4c, 0x89, 0xee}); // mov rsi, r13
+		emit(buf, {0x48, 0xb8}); // mov rax, jit_step
+		emit64(buf, reinterpret_cast<uint64_t>(&jit_step));
+		emit(buf, {0xff, 0xd0}); // call rax
+		emit(buf, {0x48, 0x81, 0xbb}); // cmp qword [rbx + instr_ptr], i + 1
+		emit32(buf, instr_ptr);
+		emit32(buf, i + 1);
+		emit(buf, {0x0f, 0x85}); // jne dispatch
+		emit32(buf, dispatch - (buf.size() + 4));
 	}
-	case TT_WRITE_STDOUT: {
-		auto write = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				std::cout << reg.data.num;
-			else {
-				char buf[REG_STR_SIZE + 1] = {0};
-				strcpy(buf, reg.data.str);
-				std::cout << buf;
-			}
-		};
-		for_each_reg(machine, write);
-		break;
+	
+	offsets[len] = buf.size();
+	emit(buf, {0x48, 0xc7, 0x83}); // mov qword [rbx + instr_ptr], len
+	emit32(buf, instr_ptr);
+	emit32(buf, len);
+	emit(buf, {0x41, 0x5d, 0x41, 0x5c, 0x5b}); // pop r13; pop r12; pop rbx
+	emit(buf, {0xc3}); // ret
+	
+	for (auto [pos, target] : fixups) {
+		uint32_t rel = offsets[target] - (pos + 4);
+		memcpy(&buf[pos], &rel, 4);
+	}
+	
+	void *mem = mmap(nullptr, buf.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return false;
+	memcpy(mem, buf.data(), buf.size());
+	if (mprotect(mem, buf.size(), PROT_READ | PROT_EXEC)) {
+		munmap(mem, buf.size());
+		return false;
+	}
+	
+	std::vector<void *> table(len + 1);
+	for (size_t i = 0; i <= len; ++i)
+		table[i] = static_cast<uint8_t *>(mem) + offsets[i];
+	
+	auto fn = reinterpret_cast<void (*)(struct machine *, program const *, void *const *)>(mem);
+	fn(&machine, &prog, table.data());
+	
+	munmap(mem, buf.size());
+	return true;
+}
+#endif
+
+static void
+emit_cpp(std::ostream &out, program const &prog)
+{
+	size_t len = prog.code.size() - 1;
+	std::vector<flow_state> states = analyze_flow(prog);
+	auto hex = [](uint16_t val) {
+		char buf[7];
+		snprintf(buf, sizeof(buf), "0x%04x", val);
+		return std::string{buf};
+	};
+	
+	// only a `.` can be jumped to dynamically unless there is a `j<`, so only
+	// those get an entry in the dispatch `switch`. loop heads also get a
+	// label for their branches.
+	bool any_target = std::any_of(prog.code.begin(), prog.code.end(), [](instr const &ins) {
+		return ins.op == OP_PUSH_JMP;
+	});
+	std::vector<bool> targets(len, any_target), labels(len, false);
+	bool dynamic = false;
+	for (size_t i = 0; i < len; ++i) {
+		opcode op = prog.code[i].op;
+		if (op == OP_SAVE_JMP)
+			targets[i] = true;
+		else if (op == OP_LOOP_HEAD)
+			targets[i] = labels[i] = true;
+		else if (op == OP_POP_JMP || op == OP_POP_JMP_COND)
+			dynamic = true;
 	}
-	case TT_WRITE_STDOUT_NEWLINE: {
-		auto write = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				std::cout << reg.data.num << '\n';
+	if (len)
+		targets[0] = true;
+	
+	out << cpp_runtime;
+	out << "char const *const lits[] = {";
+	for (std::string const &str : prog.strs) {
+		out << '"';
+		for (unsigned char ch : str) {
+			if (ch == '"' || ch == '\\')
+				out << '\\' << ch;
+			else if (ch >= ' ' && ch <= '~')
+				out << ch;
 			else {
-				char buf[REG_STR_SIZE + 1] = {0};
-				strcpy(buf, reg.data.str);
-				std::cout << buf << '\n';
+				char esc[5];
+				snprintf(esc, sizeof(esc), "\\%03o", ch);
+				out << esc;
 			}
-		};
-		for_each_reg(machine, write);
-		break;
+		}
+		out << "\", ";
 	}
-	case TT_READ_STDIN: {
-		std::string input;
-		std::cout << ">: ";
-		std::cin >> input;
-		
-		auto write_input = [&](reg &reg, size_t num) {
-			strncpy(reg.data.str, input.c_str(), REG_STR_SIZE);
-			reg.type = RT_STR;
-		};
+	out << "nullptr};\n\n";
+	
+	out << "int\nmain(void)\n{\n\tlong ip = 0;\n\t\n";
+	if (dynamic)
+		out << "dispatch:\n";
+	out << "\tswitch (ip) {\n";
+	
+	// cases are by unoptimized instruction index, which is what jumps use.
+	size_t src_len = prog.remap.size() - 1, src_i = 0;
+	auto cases = [&](size_t i) {
+		for (; src_i <= src_len && static_cast<size_t>(prog.remap[src_i]) == i; ++src_i) {
+			if (i == len || targets[i])
+				out << "\tcase " << src_i << ":\n";
+		}
+	};
+	
+	for (size_t i = 0; i < len; ++i) {
+		instr const &ins = prog.code[i];
+		flow_state const &state = states[i];
 		
-		for_each_reg(machine, write_input);
+		cases(i);
+		if (labels[i])
+			out << "\tL" << i << ":\n";
 		
-		break;
-	}
-	case TT_STR_TO_INT: {
-		auto str_to_int = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				return;
-			
-			char buf[REG_STR_SIZE + 1] = {0};
-			strcpy(buf, reg.data.str);
-			reg.data.num = atoi(buf);
-			reg.type = RT_INT;
-		};
-		for_each_reg(machine, str_to_int);
-		break;
-	}
-	case TT_INT_TO_STR: {
-		auto int_to_str = [&](reg &reg, size_t num) {
-			if (reg.type == RT_STR)
-				return;
+		// the selected registers are spelled out in visiting order when they
+		// are statically known, and looked up at runtime otherwise.
+		std::string regs = "sel()", sel_mask = "mask";
+		if (state.known) {
+			regs = "{";
+			for (uint8_t r : reg_orders[state.mode][state.rev]) {
+				if (state.mask & 1 << r)
+					regs += (regs.size() > 1 ? ", " : "") + std::to_string(r);
+			}
+			regs += "}";
 			
-			std::string str = std::to_string(reg.data.num);
-			strncpy(reg.data.str, str.c_str(), REG_STR_SIZE);
-			reg.type = RT_STR;
-		};
-		for_each_reg(machine, int_to_str);
-		break;
-	}
-	case TT_ADD: {
-		if (!machine.atoms.size())
-			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
+			sel_mask = hex(state.mask);
+		}
+		if (regs == "{}")
+			regs = "std::initializer_list<int>{}";
 		
-		auto add = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num += val;
+		// registers known to hold one type need no check.
+		std::string is_int = "is_int(r)";
+		if (sel_typed(state, state.ints))
+			is_int = "true";
+		else if (sel_typed(state, state.strs))
+			is_int = "false";
+		auto each = [&](std::string const &body) {
+			return "for (int r : " + regs + ") " + body + " ";
 		};
 		
-		for_each_reg(machine, add);
+		// immediate operators share code with the ones popping an atom.
+		opcode op = ins.op;
+		std::string pop_val = "long v; if (pop_num(v)) ";
+		for (auto [base, imm] : imm_ops) {
+			if (ins.op == imm) {
+				op = base;
+				pop_val = "long v = " + std::to_string(ins.arg) + "; ";
+			}
+		}
+		bool folded = op != ins.op;
 		
-		break;
-	}
-	case TT_SUB: {
-		if (!machine.atoms.size())
+		std::ostringstream code;
+		switch (op) {
+		case OP_LIT_STR:
+			code << "push(AT_STR, " << ins.arg << ", " << prog.str_nums[ins.arg] << ");";
 			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		auto sub = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num -= val;
-		};
-		
-		for_each_reg(machine, sub);
-		
-		break;
-	}
-	case TT_MUL: {
-		if (!machine.atoms.size())
+		case OP_LIT_CH: {
+			char ch = ins.arg;
+			code << "push(AT_CH, " << ins.arg << ", " << (ch >= '0' && ch <= '9' ? ch - '0' : 0) << ");";
+			break;
+		}
+		case OP_LIT_NUM:
+			code << "push(AT_INT, 0, " << ins.arg << ");";
+			break;
+		case OP_MODE_COL:
+		case OP_MODE_ROW:
+			code << "mode = " << (op == OP_MODE_COL ? OM_COL : OM_ROW) << "; order_dirty = true;";
+			break;
+		case OP_ORDER_REV:
+			code << "rev = !rev; order_dirty = true;";
+			break;
+		case OP_POP_ATOM:
+			if (folded) {
+				code << "{ " << each("nums[r] = " + std::to_string(ins.arg) + ";");
+				code << "ints |= " << sel_mask << "; }";
+				break;
+			}
+			code << "if (!atoms.empty()) { atom const &a = atoms.back(); if (a.type == AT_STR || a.type == AT_REG_STR) { ";
+			code << "char const *s = atom_str(a); " << each("strncpy(strs[r], s, REG_STR_SIZE);");
+			code << "ints &= ~" << sel_mask << "; } else { ";
+			code << "long v = a.type == AT_CH ? static_cast<char>(a.ref) : a.num; " << each("nums[r] = v;");
+			code << "ints |= " << sel_mask << "; } drop(); }";
+			break;
+		case OP_PUSH_ATOM:
+		case OP_PUSH_INTS:
+			code << each("push_reg(r);");
+			break;
+		case OP_WRITE_STDOUT:
+		case OP_WRITE_STDOUT_NEWLINE:
+		case OP_WRITE_INTS:
+		case OP_WRITE_INTS_NEWLINE:
+			code << each(std::string{"write_reg(r, "} + (op == OP_WRITE_STDOUT || op == OP_WRITE_INTS ? "false" : "true") + ");");
+			break;
+		case OP_READ_STDIN:
+			code << "{ std::string in = read_input(); " << each("strncpy(strs[r], in.c_str(), REG_STR_SIZE);");
+			code << "ints &= ~" << sel_mask << "; }";
+			break;
+		case OP_STR_TO_INT:
+			code << each("str_to_int(r);") << "ints |= " << sel_mask << ";";
+			break;
+		case OP_INT_TO_STR:
+			code << each("int_to_str(r);") << "ints &= ~" << sel_mask << ";";
+			break;
+		case OP_ADD:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = wrap_add(nums[r], v);") << "}";
+			break;
+		case OP_SUB:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = wrap_sub(nums[r], v);") << "}";
+			break;
+		case OP_MUL:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = wrap_mul(nums[r], v);") << "}";
+			break;
+		case OP_DIV:
+			code << "{ " << pop_val << "if (v) " << each("if (" + is_int + ") nums[r] /= v;") << "}";
+			break;
+		case OP_NUM_ADD:
+			code << each("if (" + is_int + ") nums[r] = wrap_add(nums[r], r);");
+			break;
+		case OP_NUM_SUB:
+			code << each("if (" + is_int + ") nums[r] = wrap_sub(nums[r], r);");
+			break;
+		case OP_NUM_MUL:
+			code << each("if (" + is_int + ") nums[r] = wrap_mul(nums[r], r);");
+			break;
+		case OP_NUM_DIV:
+			code << each("if (" + is_int + " && r > 0) nums[r] = static_cast<unsigned long>(nums[r]) / r;");
+			break;
+		case OP_IND_ADD:
+			code << "{ long n = 0; " << each("{ if (" + is_int + ") nums[r] = wrap_add(nums[r], n); ++n; }") << "}";
+			break;
+		case OP_IND_SUB:
+			code << "{ long n = 0; " << each("{ if (" + is_int + ") nums[r] = wrap_sub(nums[r], n); ++n; }") << "}";
+			break;
+		case OP_IND_MUL:
+			code << "{ long n = 0; " << each("{ if (" + is_int + ") nums[r] = wrap_mul(nums[r], n); ++n; }") << "}";
+			break;
+		case OP_IND_DIV:
+			code << "{ unsigned long n = 0; " << each("{ if (" + is_int + " && n > 0) nums[r] = nums[r] / n; ++n; }") << "}";
+			break;
+		case OP_POP_JMP:
+			code << "if (!jumps.empty()) { long j = jumps.back(); jumps.pop_back(); ";
+			code << "if (j >= 0 && j < " << src_len << ") { ip = j; goto dispatch; } }";
+			break;
+		case OP_POP_JMP_COND:
+			code << "if (!jumps.empty() && !atoms.empty()) { long j = jumps.back(), c; jumps.pop_back(); pop_num(c); ";
+			code << "if (j >= 0 && j < " << src_len << " && c) { ip = j; goto dispatch; } }";
+			break;
+		case OP_PUSH_JMP:
+			code << each("if (" + is_int + ") jumps.push_back(nums[r]);");
+			break;
+		case OP_SAVE_JMP:
+			code << "jumps.push_back(" << ins.arg << ");";
+			break;
+		case OP_LOOP_HEAD:
+		case OP_NOP:
+			break;
+		case OP_SET_SEL: {
+			reg_sel const &sel = prog.sels[ins.arg];
+			code << "mask = " << hex(sel.mask) << "; mode = " << sel.mode << "; rev = " << (sel.rev ? "true" : "false") << "; order_dirty = true;";
+			break;
+		}
+		case OP_BRANCH:
+			code << "goto L" << ins.arg << ";";
+			break;
+		case OP_BRANCH_COND:
+			// without an atom to pop, the jump is left on the stack as if the
+			// loop head had pushed it.
+			code << "{ long c; if (pop_num(c)) { if (c) goto L" << ins.arg << "; } ";
+			code << "else jumps.push_back(" << prog.code[ins.arg].arg << "); }";
+			break;
+		case OP_EQUAL:
+			if (folded) {
+				code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = nums[r] == v;") << "}";
+				break;
+			}
+			code << "if (!atoms.empty()) { atom const &a = atoms.back(); if (a.type == AT_INT) { ";
+			code << each("if (" + is_int + ") nums[r] = nums[r] == a.num;");
+			code << "} else if (a.type == AT_STR || a.type == AT_REG_STR) { ";
+			code << "char const *s = atom_str(a); " << each("str_equal(r, s);");
+			code << "ints |= " << sel_mask << "; } drop(); }";
+			break;
+		case OP_GREQUAL:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = nums[r] >= v;") << "}";
+			break;
+		case OP_GREATER:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = nums[r] > v;") << "}";
 			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		auto mul = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num *= val;
-		};
-		
-		for_each_reg(machine, mul);
-		
-		break;
-	}
-	case TT_DIV: {
-		if (!machine.atoms.size())
+		case OP_LESS:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = nums[r] < v;") << "}";
 			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		// division by zero not allowed.
-		if (val == 0)
+		case OP_LEQUAL:
+			code << "{ " << pop_val << each("if (" + is_int + ") nums[r] = nums[r] <= v;") << "}";
 			break;
-		
-		auto div = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num /= val;
-		};
-		
-		for_each_reg(machine, div);
-		
-		break;
-	}
-	case TT_NUM_ADD: {
-		auto num_add = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num += num;
-		};
-		for_each_reg(machine, num_add);
-		break;
-	}
-	case TT_NUM_SUB: {
-		auto num_sub = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num -= num;
-		};
-		for_each_reg(machine, num_sub);
-		break;
+		case OP_AND:
+			code << "{ bool all_set = true; " << each("if (" + is_int + " && !nums[r]) all_set = false;");
+			code << "push(AT_INT, 0, all_set); }";
+			break;
+		case OP_OR:
+			code << "{ bool any_set = false; " << each("if (" + is_int + " && nums[r]) any_set = true;");
+			code << "push(AT_INT, 0, any_set); }";
+			break;
+		case OP_NOT:
+			code << each("if (" + is_int + ") nums[r] = !nums[r];");
+			break;
+		default:
+			// mask toggles.
+			code << "mask ^= " << hex(ins.arg) << "; order_dirty = true;";
+			break;
+		}
+		std::string line = code.str();
+		while (!line.empty() && line.back() == ' ')
+			line.pop_back();
+		if (!line.empty())
+			out << "\t\t" << line << '\n';
 	}
-	case TT_NUM_MUL: {
-		auto num_mul = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num *= num;
-		};
-		for_each_reg(machine, num_mul);
-		break;
+	
+	cases(len);
+	out << "\t\tbreak;\n\t}\n\t\n\treturn 0;\n}\n";
+}
+
+static machine
+new_machine(flush_mode flush, bool batch, int in_fd, int out_fd)
+{
+	machine machine = {
+		.mask = 0x0,
+		.instr_ptr = 0,
+		.mode = OM_ROW,
+		.rev = false,
+		.order_len = 0,
+		.order_dirty = false,
+		.atoms = std::vector<atom>{},
+		.jumps = std::vector<long>{},
+		.str_arena = std::vector<char>{},
+		.out = out_sink{
+			.fd = out_fd,
+			.write = nullptr,
+			.write_ctx = nullptr,
+			.mode = flush,
+			.buf = std::vector<char>(out_fd < 0 ? 0 : OUT_BUF_SIZE),
+			.len = 0,
+		},
+		.in = in_source{
+			.batch = batch,
+			.fd = in_fd,
+			.read = nullptr,
+			.read_ctx = nullptr,
+			.mapped = false,
+			.data = nullptr,
+			.pos = 0,
+			.len = 0,
+			.buf = std::vector<char>{},
+		},
+		.prof = nullptr,
+		.trace = nullptr,
+		.snap = nullptr,
+		.budget = 0,
+	};
+	if (batch && in_fd >= 0)
+		source_open(machine.in, in_fd);
+	
+	return machine;
+}
+
+// returns the machine to the state `new_machine()` leaves it in, without
+// giving up any memory it holds. input is detached, and pending output
+// discarded.
+static void
+reset_machine(machine &machine)
+{
+	machine.regs = reg_file{};
+	machine.mask = 0x0;
+	machine.instr_ptr = 0;
+	machine.mode = OM_ROW;
+	machine.rev = false;
+	machine.order_len = 0;
+	machine.order_dirty = false;
+	machine.atoms.clear();
+	machine.jumps.clear();
+	machine.str_arena.clear();
+	machine.out.len = 0;
+	source_close(machine.in);
+	machine.in.fd = -1;
+}
+
+static void
+run(machine &machine, program const &prog, bool jit)
+{
+	reserve_stacks(machine, prog);
+	if (jit && (machine.prof || machine.trace || machine.snap)) {
+		if (machine.prof)
+			err("--profile is not supported with --jit, interpreting instead!");
+		else if (machine.trace)
+			err("--trace is not supported with --jit, interpreting instead!");
+		else
+			err("--snapshot is not supported with --jit, interpreting instead!");
+		jit = false;
 	}
-	case TT_NUM_DIV: {
-		auto num_div = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT && num > 0)
-				reg.data.num /= num;
-		};
-		for_each_reg(machine, num_div);
-		break;
+	
+	bool done = false;
+	if (jit) {
+#ifdef JIT_X86
+		done = jit_exec(machine, prog);
+		if (!done)
+			err("failed to generate native code, interpreting instead!");
+#else
+		err("--jit is not supported on this platform, interpreting instead!");
+#endif
 	}
-	case TT_IND_ADD: {
-		size_t ind = 0;
-		auto ind_add = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num += ind;
-			++ind;
-		};
-		for_each_reg(machine, ind_add);
-		break;
+	
+	if (done)
+		sink_flush(machine.out);
+	else if (machine.trace) {
+		exec<false, EH_TRACE>(machine, prog);
+		sink_flush(machine.out);
+	} else if (machine.snap) {
+		exec<false, EH_SNAPSHOT>(machine, prog);
+		sink_flush(machine.out);
+	} else if (!machine.prof) {
+		exec<false>(machine, prog);
+		sink_flush(machine.out);
+	} else {
+		std::chrono::steady_clock::time_point start = prof_now(machine);
+		exec<false, EH_PROFILE>(machine, prog);
+		
+		std::chrono::steady_clock::time_point flush_start = prof_now(machine);
+		sink_flush(machine.out);
+		prof_io(machine, flush_start);
+		if (machine.prof->timed)
+			machine.prof->total_time = std::chrono::steady_clock::now() - start;
 	}
-	case TT_IND_SUB: {
-		size_t ind = 0;
-		auto ind_sub = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num -= ind;
-			++ind;
-		};
-		for_each_reg(machine, ind_sub);
-		break;
+}
+
+// whether an instruction operates on the selected registers.
+static bool
+touches_regs(opcode op)
+{
+	switch (op) {
+	case OP_POP_JMP:
+	case OP_POP_JMP_COND:
+	case OP_PUSH_JMP:
+	case OP_SAVE_JMP:
+		return false;
+	default:
+		return (op >= OP_POP_ATOM && op <= OP_NOT) || (op >= OP_POP_IMM && op <= OP_NOP);
 	}
-	case TT_IND_MUL: {
-		size_t ind = 0;
-		auto ind_mul = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num *= ind;
-			++ind;
-		};
-		for_each_reg(machine, ind_mul);
-		break;
+}
+
+static void
+print_profile(std::ostream &out, program const &prog, profile const &prof, std::string_view src)
+{
+	size_t len = prog.code.size() - 1;
+	uint64_t total = 0, total_regs = 0, src_total = 0;
+	
+	// an instruction stands for every source operation remapped to it,
+	// which are all executed whenever it is, so that the source operations
+	// executed do not depend on what was fused.
+	std::vector<uint64_t> widths(len + 1);
+	for (size_t j = 0; j + 1 < prog.remap.size(); ++j)
+		++widths[prog.remap[j]];
+	
+	// every instruction is attributed to the line of its first token.
+	std::vector<std::pair<uint64_t, uint64_t>> lines;
+	std::vector<std::pair<uint64_t, uint64_t>> ops(OP_HALT);
+	for (size_t i = 0; i < len; ++i) {
+		uint64_t regs = touches_regs(prog.code[i].op) ? prof.regs[i] : 0;
+		if (static_cast<size_t>(prog.lines[i]) > lines.size())
+			lines.resize(prog.lines[i]);
+		lines[prog.lines[i] - 1].first += prof.counts[i];
+		lines[prog.lines[i] - 1].second += regs;
+		ops[prog.code[i].op].first += prof.counts[i];
+		ops[prog.code[i].op].second += regs;
+		total += prof.counts[i];
+		total_regs += regs;
+		src_total += prof.counts[i] * widths[i];
 	}
-	case TT_IND_DIV: {
-		size_t ind = 0;
-		auto ind_div = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT && ind > 0)
-				reg.data.num /= ind;
-			++ind;
-		};
-		for_each_reg(machine, ind_div);
-		break;
+	
+	char buf[64];
+	auto row = [&](std::string_view name, uint64_t count, uint64_t regs) {
+		snprintf(buf, sizeof(buf), "%14llu %14llu  ", static_cast<unsigned long long>(count), static_cast<unsigned long long>(regs));
+		out << buf << name << '\n';
+	};
+	
+	snprintf(buf, sizeof(buf), "%14s %14s  ", "executions", "registers");
+	std::string header = buf;
+	out << header << "line\n";
+	
+	// without the source, as when running an image, lines are only numbered.
+	for (size_t line = 0; src.empty() && line < lines.size(); ++line) {
+		if (lines[line].first)
+			row(std::to_string(line + 1), lines[line].first, lines[line].second);
 	}
-	case TT_POP_JMP: {
-		if (!machine.jumps.size())
-			break;
-		
-		long jmp = machine.jumps.top();
-		machine.jumps.pop();
-		if (jmp < 0 || jmp >= code.size())
-			break;
-		
-		machine.instr_ptr = jmp;
-		
-		break;
+	
+	size_t line = 0;
+	for (size_t pos = 0; pos < src.length(); ++line) {
+		size_t end = std::min(src.find('\n', pos), src.length());
+		if (line < lines.size() && lines[line].first)
+			row(src.substr(pos, end - pos), lines[line].first, lines[line].second);
+		else
+			out << std::string(31, ' ') << src.substr(pos, end - pos) << '\n';
+		pos = end + 1;
 	}
-	case TT_POP_JMP_COND: {
-		if (!machine.jumps.size() || !machine.atoms.size())
-			break;
-		
-		long jmp = machine.jumps.top();
-		long cond = atoi(machine.atoms.top().data.c_str());
-		machine.jumps.pop();
-		machine.atoms.pop();
-		if (jmp < 0 || jmp >= code.size())
-			break;
-		
-		if (cond)
-			machine.instr_ptr = jmp;
-		
-		break;
+	
+	out << '\n' << header << "operator\n";
+	std::vector<size_t> order;
+	for (size_t op = 0; op < ops.size(); ++op) {
+		if (ops[op].first)
+			order.push_back(op);
 	}
-	case TT_PUSH_JMP: {
-		auto push_jmp = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				machine.jumps.push(reg.data.num);
-		};
-		for_each_reg(machine, push_jmp);
-		break;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return ops[a].first > ops[b].first;
+	});
+	for (size_t op : order)
+		row(op_names[op], ops[op].first, ops[op].second);
+	row("total", total, total_regs);
+	out << '\n' << src_total << " source operations executed\n";
+	
+	if (prof.timed) {
+		std::chrono::duration<double, std::milli> io = prof.io_time, all = prof.total_time;
+		out << "\n" << all.count() << " ms in total, " << io.count() << " ms in input and output, " << (all - io).count() << " ms computing\n";
 	}
-	case TT_SAVE_JMP:
-		// needs to be subtracted by 1 in order do account for `++`.
-		machine.jumps.push(machine.instr_ptr - 1);
-		break;
-	case TT_EQUAL: {
-		if (!machine.atoms.size())
-			break;
-		
-		token tok = machine.atoms.top();
-		machine.atoms.pop();
-		
-		auto equal = [&](reg &reg, size_t num) {
-			if (tok.type == TT_LIT_NUM && reg.type == RT_INT) {
-				long val = atoi(tok.data.c_str());
-				reg.data.num = reg.data.num == val;
-			} else if (tok.type == TT_LIT_STR && reg.type == RT_STR) {
-				char buf[REG_STR_SIZE + 1] = {0};
-				strncpy(buf, reg.data.str, REG_STR_SIZE);
-				reg.type = RT_INT;
-				reg.data.num = !strcmp(buf, tok.data.c_str());
+}
+
+// calls `fn` with every index below `ntasks` across `nthreads` threads. each
+// thread starts with every `nthreads`th index, so that tasks are finished in
+// roughly ascending order, and steals from the others once done with its own.
+template<typename F>
+static void
+run_pool(size_t ntasks, unsigned nthreads, F const &fn)
+{
+	std::vector<task_queue> queues(nthreads);
+	for (size_t i = 0; i < ntasks; ++i)
+		queues[i % nthreads].tasks.push_back(i);
+	
+	auto take = [&](unsigned owner) -> std::optional<size_t> {
+		for (unsigned i = 0; i < nthreads; ++i) {
+			task_queue &queue = queues[(owner + i) % nthreads];
+			std::lock_guard<std::mutex> guard{queue.lock};
+			if (queue.tasks.empty())
+				continue;
+			
+			size_t task;
+			if (i == 0) {
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+			} else {
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
 			}
-		};
-		
-		for_each_reg(machine, equal);
-		
-		break;
-	}
-	case TT_GREQUAL: {
-		if (!machine.atoms.size())
-			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		auto grequal = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num = reg.data.num >= val;
-		};
-		
-		for_each_reg(machine, grequal);
-		
-		break;
+			return task;
+		}
+		return std::nullopt;
+	};
+	
+	// no tasks are added once running, so a thread finding every queue
+	// empty is done.
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < nthreads; ++i) {
+		threads.emplace_back([&, i] {
+			while (std::optional<size_t> task = take(i))
+				fn(*task);
+		});
 	}
-	case TT_GREATER: {
-		if (!machine.atoms.size())
-			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		auto greater = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num = reg.data.num > val;
-		};
-		
-		for_each_reg(machine, greater);
-		
-		break;
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+// the initial and final capacities of the stacks, and the heap allocations
+// made while running. a capacity left as reserved means the stack never grew.
+static void
+print_stats(std::ostream &out, machine const &machine, program const &prog, uint64_t allocs)
+{
+	char buf[64];
+	auto row = [&](char const *name, uint64_t reserved, uint64_t capacity) {
+		snprintf(buf, sizeof(buf), "%14llu %14llu  ", static_cast<unsigned long long>(reserved), static_cast<unsigned long long>(capacity));
+		out << buf << name << '\n';
+	};
+	
+	snprintf(buf, sizeof(buf), "%14s %14s  ", "reserved", "capacity");
+	out << buf << "stack\n";
+	row("atoms", prog.atoms_reserve, machine.atoms.capacity());
+	row("jumps", prog.jumps_reserve, machine.jumps.capacity());
+	row("string arena bytes", prog.arena_reserve, machine.str_arena.capacity());
+	out << '\n' << allocs << " heap allocations while running\n";
+}
+
+// identifies a program by its compiled form, with fnv-1a.
+static uint64_t
+program_hash(program const &prog)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (instr const &ins : prog.code) {
+		hash = hash_bytes(hash, &ins.op, sizeof(ins.op));
+		hash = hash_bytes(hash, &ins.arg, sizeof(ins.arg));
 	}
-	case TT_LESS: {
-		if (!machine.atoms.size())
-			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
-		
-		auto less = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num = reg.data.num < val;
-		};
-		
-		for_each_reg(machine, less);
-		
-		break;
+	for (std::string const &str : prog.strs)
+		hash = hash_bytes(hash, str.c_str(), str.length() + 1);
+	
+	return hash;
+}
+
+#ifdef POSIX_IO
+static bool
+run_many(char const *path, unsigned nthreads, bool jit, flush_mode flush, char const *cache_dir)
+{
+	std::string buf;
+	std::optional<std::string_view> src = map_file(path, buf);
+	if (!src) {
+		err("failed to open job file!");
+		return false;
 	}
-	case TT_LEQUAL: {
-		if (!machine.atoms.size())
-			break;
-		
-		long val = atoi(machine.atoms.top().data.c_str());
-		machine.atoms.pop();
+	
+	// each line names a program followed by its input and output files.
+	// programs named more than once are only compiled once.
+	std::vector<job> jobs;
+	std::vector<std::string> prog_paths;
+	std::unordered_map<std::string, size_t> prog_inds;
+	unsigned line = 0;
+	for (size_t pos = 0; pos < src->length();) {
+		size_t end = std::min(src->find('\n', pos), src->length());
+		std::istringstream fields{std::string{src->substr(pos, end - pos)}};
+		std::string prog_path, in_path, out_path, extra;
+		pos = end + 1;
+		++line;
 		
-		auto lequal = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num = reg.data.num <= val;
-		};
+		if (!(fields >> prog_path))
+			continue;
+		if (!(fields >> in_path >> out_path) || fields >> extra) {
+			prog_err(line, "expected program, input and output paths!");
+			return false;
+		}
 		
-		for_each_reg(machine, lequal);
+		auto [it, inserted] = prog_inds.try_emplace(prog_path, prog_paths.size());
+		if (inserted)
+			prog_paths.push_back(prog_path);
 		
-		break;
+		jobs.push_back(job{
+			.prog = it->second,
+			.in_path = std::move(in_path),
+			.out_path = std::move(out_path),
+			.ok = false,
+			.ms = 0.0,
+		});
 	}
-	case TT_AND: {
-		bool all_set = true;
-		auto and_ = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT && !reg.data.num)
-				all_set = false;
-		};
-		for_each_reg(machine, and_);
+	if (jobs.empty())
+		return true;
+	nthreads = std::min<size_t>(nthreads, jobs.size());
+	
+	auto start = std::chrono::steady_clock::now();
+	
+	std::vector<std::optional<program>> progs(prog_paths.size());
+	run_pool(progs.size(), nthreads, [&](size_t i) {
+		progs[i] = load_program(prog_paths[i].c_str(), cache_dir);
+	});
+	
+	run_pool(jobs.size(), nthreads, [&](size_t i) {
+		job &job = jobs[i];
+		auto job_start = std::chrono::steady_clock::now();
 		
-		token tok = {
-			.type = TT_LIT_NUM,
-			.data = all_set ? "1" : "0",
-			.line = -1,
-		};
-		machine.atoms.push(tok);
+		// the output is only truncated once the job is sure to run, so that a
+		// program which failed to load leaves earlier output alone.
+		int in_fd = progs[job.prog] ? open(job.in_path.c_str(), O_RDONLY) : -1;
+		int out_fd = in_fd >= 0 ? open(job.out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+		if (in_fd >= 0 && out_fd >= 0) {
+			machine machine = new_machine(flush, true, in_fd, out_fd);
+			run(machine, *progs[job.prog], jit);
+			source_close(machine.in);
+			job.ok = true;
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+		if (out_fd >= 0)
+			close(out_fd);
 		
-		break;
+		std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - job_start;
+		job.ms = took.count();
+	});
+	
+	std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+	
+	bool ok = true;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		std::cout << prog_paths[jobs[i].prog] << ' ' << jobs[i].in_path << ' ' << jobs[i].out_path << ": ";
+		if (jobs[i].ok)
+			std::cout << jobs[i].ms << " ms\n";
+		else
+			std::cout << "failed\n";
+		ok &= jobs[i].ok;
 	}
-	case TT_OR: {
-		bool any_set = false;
-		auto or_ = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT && reg.data.num)
-				any_set = true;
-		};
-		for_each_reg(machine, or_);
-		
-		token tok = {
-			.type = TT_LIT_NUM,
-			.data = any_set ? "1" : "0",
-			.line = -1,
-		};
-		machine.atoms.push(tok);
-		
-		break;
+	std::cout << jobs.size() << " jobs on " << nthreads << " threads in " << took.count() << " ms, " << jobs.size() / (took.count() / 1000.0) << " jobs/s\n";
+	
+	return ok;
+}
+
+static bool
+run_each(char const *path, char const *list_path, char const *out_dir, unsigned nthreads, bool jit, flush_mode flush, char const *cache_dir)
+{
+	std::optional<program> prog = load_program(path, cache_dir);
+	if (!prog)
+		return false;
+	
+	std::string buf;
+	std::optional<std::string_view> src = map_file(list_path ? list_path : "/dev/stdin", buf);
+	if (!src) {
+		err(list_path ? "failed to open input list!" : "failed to read input!");
+		return false;
 	}
-	case TT_NOT: {
-		auto not_ = [&](reg &reg, size_t num) {
-			if (reg.type == RT_INT)
-				reg.data.num = !reg.data.num;
-		};
-		for_each_reg(machine, not_);
-		break;
+	
+	// each line is either an input itself or the path of a file holding one.
+	// empty lines are only inputs in their own right.
+	std::vector<std::string_view> inputs;
+	for (size_t pos = 0; pos < src->length();) {
+		size_t end = std::min(src->find('\n', pos), src->length());
+		if (!list_path || end > pos)
+			inputs.push_back(src->substr(pos, end - pos));
+		pos = end + 1;
 	}
+	if (inputs.empty())
+		return true;
+	nthreads = std::min<size_t>(nthreads, inputs.size());
+	
+	// without an output directory, outputs are kept in memory until those of
+	// all earlier inputs have been written.
+	out_sink out = {
+		.fd = 1,
+		.write = nullptr,
+		.write_ctx = nullptr,
+		.mode = flush,
+		.buf = std::vector<char>(OUT_BUF_SIZE),
+		.len = 0,
+	};
+	std::vector<std::vector<char>> outputs(inputs.size());
+	std::vector<bool> done(inputs.size(), false);
+	size_t next = 0;
+	std::mutex out_lock;
+	bool ok = true;
+	
+	run_pool(inputs.size(), nthreads, [&](size_t i) {
+		int in_fd = -1, out_fd = -1;
+		bool failed = false;
+		if (list_path) {
+			in_fd = open(std::string{inputs[i]}.c_str(), O_RDONLY);
+			if (in_fd < 0) {
+				err("failed to open input file " + std::string{inputs[i]} + "!");
+				failed = true;
+			}
+		}
+		if (out_dir && !failed) {
+			std::string out_path = std::string{out_dir} + '/' + std::to_string(i + 1) + ".out";
+			out_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (out_fd < 0) {
+				err("failed to open output file " + out_path + "!");
+				failed = true;
+			}
+		}
 		
-	default:
-		break;
+		if (!failed) {
+			machine machine = new_machine(FM_FULL, true, in_fd, out_fd);
+			if (!list_path)
+				source_view(machine.in, inputs[i]);
+			run(machine, *prog, jit);
+			source_close(machine.in);
+			
+			machine.out.buf.resize(machine.out.len);
+			outputs[i] = std::move(machine.out.buf);
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+		if (out_fd >= 0)
+			close(out_fd);
+		
+		std::lock_guard<std::mutex> guard{out_lock};
+		ok &= !failed;
+		for (done[i] = true; next < inputs.size() && done[next]; ++next) {
+			sink_write(out, outputs[next].data(), outputs[next].size());
+			outputs[next] = std::vector<char>{};
+		}
+	});
+	sink_flush(out);
+	
+	return ok;
+}
+#endif
+
+static thread_local std::string lib_error;
+
+ematrm_program *
+ematrm_prepare(char const *src, size_t len)
+{
+	if (is_image(std::string_view{src, len})) {
+		std::optional<program> image = read_image(std::string_view{src, len}, lib_error);
+		return image ? new ematrm_program{std::move(*image)} : nullptr;
 	}
+	
+	std::optional<std::vector<token>> toks = lex(std::string_view{src, len}, lib_error);
+	if (!toks)
+		return nullptr;
+	
+	ematrm_program *prog = new ematrm_program{compile(*toks)};
+	optimize(prog->prog);
+	resolve_loops(prog->prog);
+	specialize_types(prog->prog);
+	specialize_sels(prog->prog);
+	size_stacks(prog->prog);
+	return prog;
+}
+
+void
+ematrm_program_free(ematrm_program *prog)
+{
+	delete prog;
+}
+
+char const *
+ematrm_error(void)
+{
+	return lib_error.c_str();
+}
+
+ematrm_machine *
+ematrm_machine_new(void)
+{
+	return new ematrm_machine{new_machine(FM_FULL, true, -1, -1)};
+}
+
+void
+ematrm_machine_free(ematrm_machine *machine)
+{
+	delete machine;
+}
+
+void
+ematrm_reset(ematrm_machine *machine)
+{
+	reset_machine(machine->state);
+}
+
+void
+ematrm_set_input(ematrm_machine *machine, char const *data, size_t len)
+{
+	source_close(machine->state.in);
+	source_view(machine->state.in, std::string_view{data, len});
+}
+
+void
+ematrm_set_input_fn(ematrm_machine *machine, ematrm_read_fn fn, void *ctx)
+{
+	in_source &in = machine->state.in;
+	source_close(in);
+	in.fd = -1;
+	in.read = fn;
+	in.read_ctx = ctx;
+	in.buf.resize(IN_BUF_SIZE);
+	in.data = in.buf.data();
+}
+
+void
+ematrm_set_output_fn(ematrm_machine *machine, ematrm_write_fn fn, void *ctx)
+{
+	out_sink &out = machine->state.out;
+	sink_flush(out);
+	out.write = fn;
+	out.write_ctx = ctx;
+	if (fn && out.buf.size() < OUT_BUF_SIZE)
+		out.buf.resize(OUT_BUF_SIZE);
+}
+
+char const *
+ematrm_output(ematrm_machine const *machine, size_t *len)
+{
+	out_sink const &out = machine->state.out;
+	*len = out.write ? 0 : out.len;
+	return out.buf.data();
+}
+
+// runs are always interpreted, since native code would be generated again for
+// every one.
+ematrm_status
+ematrm_run(ematrm_machine *machine, ematrm_program const *prog, uint64_t budget)
+{
+	reserve_stacks(machine->state, prog->prog);
+	if (budget) {
+		machine->state.budget = budget;
+		exec<false, EH_BUDGET>(machine->state, prog->prog);
+	} else
+		exec<false>(machine->state, prog->prog);
+	sink_flush(machine->state.out);
+	
+	return prog->prog.code[machine->state.instr_ptr].op == OP_HALT ? EMATRM_HALTED : EMATRM_BUDGET;
 }
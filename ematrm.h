@@ -0,0 +1,68 @@
+#ifndef EMATRM_H
+#define EMATRM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a lexed and compiled program. it is never modified once prepared, and so can
+// be run by any number of machines at once, from any number of threads.
+typedef struct ematrm_program ematrm_program;
+
+// the state of a program being run. a machine is only used by one thread at a
+// time, and can be reset and reused for any number of runs.
+typedef struct ematrm_machine ematrm_machine;
+
+// called with `len` bytes of program output.
+typedef void (*ematrm_write_fn)(void *ctx, char const *data, size_t len);
+
+// fills `buf` with up to `len` bytes of program input, returning how many,
+// or zero at the end of input.
+typedef size_t (*ematrm_read_fn)(void *ctx, char *buf, size_t len);
+
+enum ematrm_status {
+	EMATRM_HALTED = 0,
+	EMATRM_BUDGET,
+};
+
+// `src` is either source text or an image written by `--compile`. returns null
+// if it fails to lex or load, with the reason left for `ematrm_error()`.
+ematrm_program *ematrm_prepare(char const *src, size_t len);
+void ematrm_program_free(ematrm_program *prog);
+
+// the message for the last failure on the calling thread.
+char const *ematrm_error(void);
+
+ematrm_machine *ematrm_machine_new(void);
+void ematrm_machine_free(ematrm_machine *machine);
+
+// returns the machine to its initial state, keeping the memory it has already
+// allocated and its output callback. input has to be given again.
+void ematrm_reset(ematrm_machine *machine);
+
+// input is either all in memory, in which case it is used in place and has to
+// outlive the run, or read through `fn` as needed. without either, a program
+// reads empty words.
+void ematrm_set_input(ematrm_machine *machine, char const *data, size_t len);
+void ematrm_set_input_fn(ematrm_machine *machine, ematrm_read_fn fn, void *ctx);
+
+// output is passed to `fn` in large chunks, and always before a run returns.
+// without it, output is kept in memory until the machine is reset.
+void ematrm_set_output_fn(ematrm_machine *machine, ematrm_write_fn fn, void *ctx);
+char const *ematrm_output(ematrm_machine const *machine, size_t *len);
+
+// runs `prog` from wherever the machine stopped for at most `budget`
+// executed instructions, or until it halts if `budget` is zero. instructions
+// are counted after optimization, so that fused operators count once and loop
+// heads skipped by resolved loops not at all. once out of budget, running the
+// same program again carries on.
+enum ematrm_status ematrm_run(ematrm_machine *machine, ematrm_program const *prog, uint64_t budget);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif